@@ -1,8 +1,151 @@
 #include "I2C_TPA2016.h"
+#ifndef TPA2016_LEAN
+#include "I2C_TPA2016_Scheduler.h"
 
-I2C_TPA2016::I2C_TPA2016(uint8_t bus, uint8_t address) {
+#include <algorithm>
+#endif
+
+#ifdef TPA2016_PROBES
+// The tracer increments the semaphore of a probe while it is attached
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TPA2016_SEMAPHORE(probe) TPA2016_INLINE unsigned short tpa2016_##probe##_semaphore __attribute__((section(".probes"))) = 0
+TPA2016_SEMAPHORE(read);
+TPA2016_SEMAPHORE(write);
+TPA2016_SEMAPHORE(rmw);
+TPA2016_SEMAPHORE(call);
+TPA2016_SEMAPHORE(read_block);
+TPA2016_SEMAPHORE(write_block);
+TPA2016_SEMAPHORE(rdwr);
+
+static inline uint64_t probeClock() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Only read the clock if someone listens to the probe
+#define TPA2016_PROBE_START(probe) uint64_t probe##Start = __builtin_expect(tpa2016_##probe##_semaphore, 0) ? probeClock() : 0
+/*
+ * Arguments : bus, address, register, value, errno (positive, 0 on success), duration in ns (0 if the probe was attached meanwhile)
+ * value is the register value read or written, 0 on read error
+ */
+#define TPA2016_PROBE(probe, reg, val, res) do { \
+		if(__builtin_expect(tpa2016_call_semaphore, 0)) { \
+			probed().value = (val); \
+			probed().error = (res) < 0 ? -(res) : 0; \
+		} \
+		if(__builtin_expect(tpa2016_##probe##_semaphore, 0)) { \
+			DTRACE_PROBE6(tpa2016, probe, bus, address, reg, (val), (res) < 0 ? -(res) : 0, probe##Start ? probeClock() - probe##Start : 0); \
+		} \
+	} while(0)
+// Block transfers. Arguments : bus, address, first register, number of registers, errno, duration in ns
+#define TPA2016_BLOCK_PROBE(probe, first, count, res) do { \
+		if(__builtin_expect(tpa2016_call_semaphore, 0)) { \
+			probed().error = (res) < 0 ? -(res) : 0; \
+		} \
+		if(__builtin_expect(tpa2016_##probe##_semaphore, 0)) { \
+			DTRACE_PROBE6(tpa2016, probe, bus, address, first, count, (res) < 0 ? -(res) : 0, probe##Start ? probeClock() - probe##Start : 0); \
+		} \
+	} while(0)
+// I2C_RDWR ioctl of scatterWrite(). Arguments : bus, number of messages, number of registers written, errno, duration in ns
+#define TPA2016_RDWR_PROBE(bus, messages, count, res) do { \
+		if(__builtin_expect(tpa2016_rdwr_semaphore, 0)) { \
+			DTRACE_PROBE5(tpa2016, rdwr, bus, messages, count, (res) < 0 ? -(res) : 0, rdwrStart ? probeClock() - rdwrStart : 0); \
+		} \
+	} while(0)
+
+class I2C_TPA2016::CallProbe {
+public:
+	CallProbe(const I2C_TPA2016* device, const char* name, uint8_t reg) : device(device), name(name), reg(reg) {
+		start = 0;
+		if(__builtin_expect(tpa2016_call_semaphore, 0)) {
+			start = probeClock();
+			probed() = Probed();
+		}
+	}
+	// Arguments : function name, bus, address, register, last value transferred, errno, duration in ns
+	~CallProbe() {
+		// Not fired if the probe was attached during the call : the transfers were not recorded
+		if(__builtin_expect(start != 0, 0)) {
+			DTRACE_PROBE7(tpa2016, call, name, device->bus, device->address, reg, probed().value, probed().error, probeClock() - start);
+		}
+	}
+private:
+	const I2C_TPA2016* device;
+	const char* name;
+	uint8_t reg;
+	uint64_t start;
+};
+#define TPA2016_PROBE_CALL(reg) CallProbe callProbe(this, __func__, reg)
+#else
+#define TPA2016_PROBE_START(probe) static_cast<void>(0)
+#define TPA2016_PROBE(probe, reg, val, res) static_cast<void>(0)
+#define TPA2016_BLOCK_PROBE(probe, first, count, res) static_cast<void>(0)
+#define TPA2016_RDWR_PROBE(bus, messages, count, res) static_cast<void>(0)
+#define TPA2016_PROBE_CALL(reg) static_cast<void>(0)
+#endif
+
+#ifndef TPA2016_LEAN
+// Identify a register for the scheduler, which serves a single bus : the address is enough to tell amplifiers apart
+#define TPA2016_KEY(address, reg) ((static_cast<uint32_t>(address) << 8) | (reg))
+
+class I2C_TPA2016::Access {
+public:
+	Access(I2C_TPA2016* device) : lock(device->mutex), device(device) {
+		device->depth++;
+	}
+	~Access() {
+		device->depth--;
+	}
+private:
+	std::lock_guard<std::recursive_mutex> lock;
+	I2C_TPA2016* device;
+};
+// Serialize the public functions of an amplifier, except while they wait for the scheduler (see transfer())
+#define TPA2016_LOCK() Access access(this)
+#else
+#define TPA2016_LOCK() static_cast<void>(0)
+#endif
+
+/*
+ * For each register, bits which are expected to read back as they were written.
+ * Fault and thermal flags are set by the amplifier and unused bits may read anything.
+ */
+static const uint8_t TPA2016_STABLE_BITS[TPA2016_REGISTERS + 1] = {
+	0x00,
+	static_cast<uint8_t>(~(TPA2016_SETUP_VOLATILE | 0x02)),
+	0x3F,
+	0x3F,
+	0x3F,
+	0x3F,
+	0xFF,
+	0xF3
+};
+
+// Power-on value of each register, as given by the datasheet
+static const uint8_t TPA2016_DEFAULTS[TPA2016_REGISTERS + 1] = {
+	0x00,
+	0xC3,
+	0x05,
+	0x0B,
+	0x00,
+	0x06,
+	0x3A,
+	0xC2
+};
+
+TPA2016_INLINE I2C_TPA2016::I2C_TPA2016(uint8_t bus, uint8_t address) {
 	this->bus = bus;
 	this->address = address;
+	written = 0;
+	policy = TPA2016_VERIFY_POLICY::NONE;
+	reapply = false;
+	recovery = false;
+	recoveryStats = TPA2016_RECOVERY_METRICS();
+#ifndef TPA2016_LEAN
+	depth = 0;
+	staging = false;
+#endif
 
 	// Open I2C device
 	char filename[MAX_BUF_NAME];
@@ -10,32 +153,43 @@ I2C_TPA2016::I2C_TPA2016(uint8_t bus, uint8_t address) {
 	snprintf(filename, sizeof(filename), "/dev/i2c-%d", bus);
 	if((fd = open(filename, O_RDWR)) < 0) {
 		snprintf(error, sizeof(error), "Failed to initialize I2C on bus %d", bus);
-		throw std::runtime_error(error);
+		TPA2016_RAISE(std::runtime_error, -errno, error);
 	}
 
 	if (ioctl(fd, I2C_SLAVE, address) < 0){
+		int code = -errno;
+		close(fd);
+		fd = -1;
 		snprintf(error, sizeof(error), "Failed to target TPA as a slave (address %#x)", address);
-		throw std::runtime_error(error);
+		TPA2016_RAISE(std::runtime_error, code, error);
 	}
 
 	/* Check if all features used by this code are available, i.e. :
 		- Reading and writing bytes
 		- Combined read/write transaction without stop bit in between (used by i2c_smbus_read_byte_data and needed by the TPA2016D2 to read a register).
 	* See https://www.kernel.org/doc/Documentation/i2c/functionality for details */
-	uint64_t availableFuncs;
-	if (ioctl(fd, I2C_FUNCS, &availableFuncs) < 0) {
-		throw std::runtime_error("Unable to check I2C adapter functionalities");
+	if (ioctl(fd, I2C_FUNCS, &funcs) < 0) {
+		int code = -errno;
+		close(fd);
+		fd = -1;
+		TPA2016_RAISE(std::runtime_error, code, "Unable to check I2C adapter functionalities");
 	}
 
-	if (!(availableFuncs & (I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_I2C))) {
-		throw std::runtime_error("Desired functionality is not available");
+	if (!(funcs & (I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_I2C))) {
+		close(fd);
+		fd = -1;
+		TPA2016_RAISE(std::runtime_error, -EOPNOTSUPP, "Desired functionality is not available");
 	}
 
 	// Activate all features of the amplifier
 	softwareShutdown(false);
 }
 
-I2C_TPA2016::~I2C_TPA2016() {
+TPA2016_INLINE I2C_TPA2016::~I2C_TPA2016() {
+	// Construction failed (only possible without exceptions)
+	if(fd < 0) {
+		return;
+	}
 	// Disable most features
 	softwareShutdown(true);
 
@@ -45,155 +199,564 @@ I2C_TPA2016::~I2C_TPA2016() {
 	}
 }
 
-void I2C_TPA2016::softMode() {
+TPA2016_INLINE void I2C_TPA2016::softMode() {
+	TPA2016_LOCK();
 	setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_1);
+	TPA2016_RETURN_ON_ERROR();
 	// Recommended pop paramters (section 9.4.2)
 	setAttackTime(2.56f);
+	TPA2016_RETURN_ON_ERROR();
 	setReleaseTime(3.288f);
+	TPA2016_RETURN_ON_ERROR();
 	setHoldTime(0.0137f);
+	TPA2016_RETURN_ON_ERROR();
 
 	enableLimiter(true);
+	TPA2016_RETURN_ON_ERROR();
 	setLimiterLevel(6.5f);
+	TPA2016_RETURN_ON_ERROR();
 
 	setMaxGain(18);
+	TPA2016_RETURN_ON_ERROR();
 	setGain(0);
+	TPA2016_RETURN_ON_ERROR();
+
+	if(policy == TPA2016_VERIFY_POLICY::BATCHED) {
+		verify();
+	}
 }
 
-void I2C_TPA2016::hardcoreMode() {
+TPA2016_INLINE void I2C_TPA2016::hardcoreMode() {
+	TPA2016_LOCK();
 	enableLimiter(true);
+	TPA2016_RETURN_ON_ERROR();
 	setLimiterLevel(9.0f);
+	TPA2016_RETURN_ON_ERROR();
 	setReleaseTime(0.1644f);
+	TPA2016_RETURN_ON_ERROR();
 	setMaxGain(30);
+	TPA2016_RETURN_ON_ERROR();
 	setGain(10);
+	TPA2016_RETURN_ON_ERROR();
+
+	if(policy == TPA2016_VERIFY_POLICY::BATCHED) {
+		verify();
+	}
+}
+
+template<typename Op>
+TPA2016_INLINE int I2C_TPA2016::transfer(Op op, uint8_t reg, bool read, uint8_t count) {
+	TPA2016_CLEAR_ERROR();
+#ifndef TPA2016_LEAN
+	// Kept alive even if another thread changes the scheduler while this one waits
+	std::shared_ptr<I2C_TPA2016_Scheduler> scheduler = this->scheduler;
+	if(scheduler) {
+		uint32_t key = TPA2016_KEY(address, reg);
+		std::shared_future<int> result;
+		if(read) {
+			// Only a single register read can be served by an identical pending read
+			result = scheduler->submit(op, count == 1 ? key : 0, true);
+		}
+		else if(count == 1) {
+			result = scheduler->submit(op, key, false);
+		}
+		else {
+			std::vector<uint32_t> keys;
+			for(uint8_t i = 0; i < count; ++i) {
+				keys.push_back(key + i);
+			}
+			result = scheduler->submit(op, keys);
+		}
+		/*
+		 * Let other threads use the amplifier meanwhile : the worker may serve their transfers first if they have a higher priority.
+		 * op must therefore not touch the state of the amplifier, it only accesses the bus.
+		 */
+		uint8_t held = depth;
+		depth = 0;
+		for(uint8_t i = 0; i < held; ++i) {
+			mutex.unlock();
+		}
+		int res = result.get();
+		for(uint8_t i = 0; i < held; ++i) {
+			mutex.lock();
+		}
+		depth = held;
+		return res;
+	}
+#else
+	static_cast<void>(reg);
+	static_cast<void>(read);
+	static_cast<void>(count);
+#endif
+	return op();
 }
 
-void I2C_TPA2016::writeI2C(uint8_t regAddress, uint8_t value) {
-	if(i2c_smbus_write_byte_data(fd, regAddress, value) < 0)
+TPA2016_INLINE void I2C_TPA2016::writeI2C(uint8_t regAddress, uint8_t value) {
+#ifndef TPA2016_LEAN
+	if(staging) {
+		stage[regAddress] = value;
+		staged |= 1 << regAddress;
+		return;
+	}
+#endif
+	TPA2016_PROBE_START(write);
+	uint32_t number = 0;
+	int res = transfer([this, regAddress, value, &number]() {
+		if(i2c_smbus_write_byte_data(fd, regAddress, value) < 0) {
+			return -errno;
+		}
+		number = nextTransfer();
+		return 0;
+	}, regAddress, false);
+	TPA2016_PROBE(write, regAddress, value, res);
+	if(res < 0)
 	{
-		throw std::runtime_error(strerror(errno));
+		TPA2016_RAISE(std::runtime_error, res, strerror(-res));
+	}
+	record(regAddress, value, number);
+
+	if(policy == TPA2016_VERIFY_POLICY::PER_WRITE) {
+		uint8_t actual = readI2C(regAddress);
+		TPA2016_RETURN_ON_ERROR();
+		check(regAddress, actual);
 	}
 }
 
-uint8_t I2C_TPA2016::readI2C(uint8_t regAddress) {
-	uint8_t res;
-	if((res = i2c_smbus_read_byte_data(fd, regAddress)) < 0)
+TPA2016_INLINE uint8_t I2C_TPA2016::readI2C(uint8_t regAddress, bool detect) {
+#ifndef TPA2016_LEAN
+	if(staging) {
+		return stage[regAddress];
+	}
+#endif
+	// Must be signed : smbus calls return -1 on error
+	TPA2016_PROBE_START(read);
+	int res = transfer([this, regAddress]() {
+		int value = i2c_smbus_read_byte_data(fd, regAddress);
+		return value < 0 ? -errno : value;
+	}, regAddress, true);
+	TPA2016_PROBE(read, regAddress, res < 0 ? 0 : res, res);
+	if(res < 0)
 	{
-		throw std::runtime_error(strerror(errno));
+		TPA2016_RAISE(std::runtime_error, res, strerror(-res), 0);
+	}
+	if(detect && recovery && detectReset(regAddress, res)) {
+		// Keep fresh status bits, the others have just been restored
+		uint8_t mask = TPA2016_STABLE_BITS[regAddress];
+		return (image[regAddress] & mask) | (res & ~mask);
 	}
 	return res;
 }
 
-void I2C_TPA2016::boolWrite(uint8_t reg, uint8_t bit, bool enable) {
-	uint8_t reg_value = readI2C(reg);
-	if(enable)
-		reg_value |= bit;
-	else
-		reg_value &= ~bit;
-	writeI2C(reg, reg_value);
+TPA2016_INLINE void I2C_TPA2016::updateI2C(uint8_t regAddress, uint8_t mask, uint8_t bits) {
+#ifndef TPA2016_LEAN
+	if(staging) {
+		stage[regAddress] = (stage[regAddress] & ~mask) | bits;
+		staged |= 1 << regAddress;
+		return;
+	}
+#endif
+	TPA2016_PROBE_START(rmw);
+	TPA2016_PROBE_START(read);
+	TPA2016_PROBE_START(write);
+	// The transfer cannot look at the image : take what is needed to recognize a reset (see detectReset()) beforehand
+	bool suspect = recovery && (written & (1 << regAddress));
+	uint8_t expected = image[regAddress];
+	uint8_t before = 0;
+	uint8_t after = 0;
+	uint32_t number = 0;
+	auto op = [this, regAddress, mask, bits, &suspect, expected, &before, &after, &number]() {
+		int value = i2c_smbus_read_byte_data(fd, regAddress);
+		if(value < 0) {
+			return -errno;
+		}
+		before = value;
+		uint8_t stable = TPA2016_STABLE_BITS[regAddress];
+		// Don't build on a reset register : its configuration must be restored first
+		if(suspect && ((expected ^ before) & stable) && !((before ^ TPA2016_DEFAULTS[regAddress]) & stable)) {
+			return 0;
+		}
+		after = (before & ~mask) | bits;
+		if(i2c_smbus_write_byte_data(fd, regAddress, after) < 0) {
+			return -errno;
+		}
+		number = nextTransfer();
+		return 0;
+	};
+	int res = transfer(op, regAddress, false);
+	if(res >= 0 && !number) {
+		detectReset(regAddress, before);
+		TPA2016_RETURN_ON_ERROR();
+		// Modify the restored value, or the current one if it was not a reset
+		suspect = false;
+		res = transfer(op, regAddress, false);
+	}
+	// Both probes of a read-modify-write report the duration of the whole transfer
+	TPA2016_PROBE(read, regAddress, before, res);
+	if(number) {
+		TPA2016_PROBE(write, regAddress, after, res);
+	}
+	TPA2016_PROBE(rmw, regAddress, after, res);
+	if(res < 0)
+	{
+		TPA2016_RAISE(std::runtime_error, res, strerror(-res));
+	}
+	record(regAddress, after, number);
+
+	if(policy == TPA2016_VERIFY_POLICY::PER_WRITE) {
+		uint8_t actual = readI2C(regAddress);
+		TPA2016_RETURN_ON_ERROR();
+		check(regAddress, actual);
+	}
+}
+
+TPA2016_INLINE void I2C_TPA2016::readBlock(uint8_t first, uint8_t count, uint8_t* values) {
+	if(funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) {
+		// The TPA2016D2 auto-increments the register address after each byte
+		TPA2016_PROBE_START(read_block);
+		int res = transfer([this, first, count, values]() {
+			int read = i2c_smbus_read_i2c_block_data(fd, first, count, values);
+			if(read < 0) {
+				return -errno;
+			}
+			return read == count ? 0 : -EIO;
+		}, first, true, count);
+		TPA2016_BLOCK_PROBE(read_block, first, count, res);
+		if(res < 0) {
+			TPA2016_RAISE(std::runtime_error, res, strerror(-res));
+		}
+	}
+	else {
+		for(uint8_t i = 0; i < count; ++i) {
+			values[i] = readI2C(first + i, false);
+			TPA2016_RETURN_ON_ERROR();
+		}
+	}
+}
+
+TPA2016_INLINE void I2C_TPA2016::writeBlock(uint8_t first, uint8_t count, const uint8_t* values) {
+	// values may be the image, which other threads can change while the transfer waits for the scheduler
+	uint8_t buffer[TPA2016_REGISTERS];
+	memcpy(buffer, values, count);
+	if(count > 1 && (funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+		TPA2016_PROBE_START(write_block);
+		uint32_t number = 0;
+		int res = transfer([this, first, count, &buffer, &number]() {
+			if(i2c_smbus_write_i2c_block_data(fd, first, count, buffer) < 0) {
+				return -errno;
+			}
+			number = nextTransfer();
+			return 0;
+		}, first, false, count);
+		TPA2016_BLOCK_PROBE(write_block, first, count, res);
+		if(res < 0) {
+			TPA2016_RAISE(std::runtime_error, res, strerror(-res));
+		}
+		for(uint8_t i = 0; i < count; ++i) {
+			if(written & (1 << (first + i))) {
+				record(first + i, buffer[i], number);
+			}
+		}
+		return;
+	}
+	for(uint8_t i = 0; i < count; ++i) {
+		uint8_t reg = first + i;
+		uint8_t value = buffer[i];
+		TPA2016_PROBE_START(write);
+		uint32_t number = 0;
+		int res = transfer([this, reg, value, &number]() {
+			if(i2c_smbus_write_byte_data(fd, reg, value) < 0) {
+				return -errno;
+			}
+			number = nextTransfer();
+			return 0;
+		}, reg, false);
+		TPA2016_PROBE(write, reg, value, res);
+		if(res < 0) {
+			TPA2016_RAISE(std::runtime_error, res, strerror(-res));
+		}
+		if(written & (1 << reg)) {
+			record(reg, value, number);
+		}
+	}
+}
+
+TPA2016_INLINE bool I2C_TPA2016::detectReset(uint8_t reg, uint8_t actual) {
+	uint8_t mask = TPA2016_STABLE_BITS[reg];
+	// Only a written register reading its default value instead of the expected one is suspicious
+	if(!(written & (1 << reg)) || !((image[reg] ^ actual) & mask) || ((actual ^ TPA2016_DEFAULTS[reg]) & mask)) {
+		return false;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	uint8_t values[TPA2016_REGISTERS + 1];
+	readBlock(TPA2016_SETUP, TPA2016_REGISTERS, values + TPA2016_SETUP);
+	TPA2016_RETURN_ON_ERROR(false);
+	for(uint8_t r = TPA2016_SETUP; r <= TPA2016_REGISTERS; ++r) {
+		mask = TPA2016_STABLE_BITS[r];
+		bool changedByUs = (written & (1 << r)) && ((image[r] ^ TPA2016_DEFAULTS[r]) & mask);
+		// Someone else changed this register, but the amplifier kept our configuration elsewhere
+		if(changedByUs && ((values[r] ^ TPA2016_DEFAULTS[r]) & mask)) {
+			return false;
+		}
+	}
+	uint8_t writes = restore(values);
+	TPA2016_RETURN_ON_ERROR(false);
+
+	std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+	recoveryStats.resets++;
+	recoveryStats.lastWrites = writes;
+	recoveryStats.lastRecovery = duration;
+	recoveryStats.totalRecovery += duration;
+	if(duration > recoveryStats.maxRecovery) {
+		recoveryStats.maxRecovery = duration;
+	}
+	return true;
+}
+
+TPA2016_INLINE uint8_t I2C_TPA2016::restore(const uint8_t* values) {
+	uint8_t first = 0;
+	uint8_t last = 0;
+	for(uint8_t reg = TPA2016_SETUP; reg <= TPA2016_REGISTERS; ++reg) {
+		if((written & (1 << reg)) && ((image[reg] ^ values[reg]) & TPA2016_STABLE_BITS[reg])) {
+			first = first ? first : reg;
+			last = reg;
+		}
+	}
+	if(!first) {
+		return 0;
+	}
+	// Registers in between which were never written keep their current value
+	uint8_t buffer[TPA2016_REGISTERS];
+	for(uint8_t reg = first; reg <= last; ++reg) {
+		buffer[reg - first] = (written & (1 << reg)) ? image[reg] : values[reg];
+	}
+	// Writing 0 to fault flags clears them, and writing 1 has no effect : a latched fault must stay for the user to see
+	if(first == TPA2016_SETUP) {
+		buffer[0] |= TPA2016_SETUP_R_FAULT | TPA2016_SETUP_L_FAULT;
+	}
+	uint8_t count = last - first + 1;
+	writeBlock(first, count, buffer);
+	TPA2016_RETURN_ON_ERROR(0);
+	return (count > 1 && (funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) ? 1 : count;
+}
+
+TPA2016_INLINE bool I2C_TPA2016::check(uint8_t reg, uint8_t actual, std::vector<TPA2016_MISMATCH>* mismatches) {
+	uint8_t mask = TPA2016_STABLE_BITS[reg];
+	if(!(written & (1 << reg)) || (image[reg] & mask) == (actual & mask)) {
+		return true;
+	}
+	TPA2016_MISMATCH mismatch = { reg, static_cast<uint8_t>(image[reg] & mask), static_cast<uint8_t>(actual & mask) };
+	if(mismatches) {
+		mismatches->push_back(mismatch);
+	}
+	if(mismatchHandler) {
+		mismatchHandler(mismatch);
+	}
+	// Don't use writeI2C, we don't want to verify again and loop forever if the amplifier keeps rejecting the value
+	if(reapply) {
+		uint8_t value = image[reg];
+		// Writing 0 to fault flags clears them, and writing 1 has no effect : a short latched since the last write must stay for the user to see
+		if(reg == TPA2016_SETUP) {
+			value |= TPA2016_SETUP_R_FAULT | TPA2016_SETUP_L_FAULT;
+		}
+		TPA2016_PROBE_START(write);
+		uint32_t number = 0;
+		int res = transfer([this, reg, value, &number]() {
+			if(i2c_smbus_write_byte_data(fd, reg, value) < 0) {
+				return -errno;
+			}
+			number = nextTransfer();
+			return 0;
+		}, reg, false);
+		TPA2016_PROBE(write, reg, value, res);
+		if(res < 0) {
+			TPA2016_RAISE(std::runtime_error, res, strerror(-res), false);
+		}
+		record(reg, value, number);
+	}
+	return false;
+}
+
+TPA2016_INLINE uint32_t I2C_TPA2016::nextTransfer() {
+#ifndef TPA2016_LEAN
+	static std::atomic<uint32_t> transfers(0);
+	uint32_t number = ++transfers;
+	return number ? number : ++transfers;
+#else
+	return 0;
+#endif
+}
+
+TPA2016_INLINE void I2C_TPA2016::record(uint8_t reg, uint8_t value, uint32_t transfer) {
+#ifndef TPA2016_LEAN
+	// Another thread recorded a write performed after this one : the amplifier holds its value
+	if((written & (1 << reg)) && static_cast<int32_t>(transfer - sequence[reg]) < 0) {
+		return;
+	}
+	sequence[reg] = transfer;
+#else
+	static_cast<void>(transfer);
+#endif
+	image[reg] = value;
+	written |= 1 << reg;
+}
+
+TPA2016_INLINE void I2C_TPA2016::boolWrite(uint8_t reg, uint8_t bit, bool enable) {
+	updateI2C(reg, bit, enable ? bit : 0);
 }
 
-void I2C_TPA2016::enableChannels(bool right, bool left) {
+TPA2016_INLINE void I2C_TPA2016::enableChannels(bool right, bool left) {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	boolWrite(TPA2016_SETUP, TPA2016_SETUP_R_EN, right);
+	TPA2016_RETURN_ON_ERROR();
 	boolWrite(TPA2016_SETUP, TPA2016_SETUP_L_EN, left);
 }
 
-bool I2C_TPA2016::rightEnabled() {
+TPA2016_INLINE bool I2C_TPA2016::rightEnabled() {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	return readI2C(TPA2016_SETUP) & TPA2016_SETUP_R_EN;
 }
 
-bool I2C_TPA2016::leftEnabled() {
+TPA2016_INLINE bool I2C_TPA2016::leftEnabled() {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	return readI2C(TPA2016_SETUP) & TPA2016_SETUP_L_EN;
 }
 
-void I2C_TPA2016::softwareShutdown(bool shutdown) {
+TPA2016_INLINE void I2C_TPA2016::softwareShutdown(bool shutdown) {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	boolWrite(TPA2016_SETUP, TPA2016_SETUP_SWS, shutdown);
 }
 
-bool I2C_TPA2016::ready() {
+TPA2016_INLINE bool I2C_TPA2016::ready() {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	// TPA2016_SETUP_SWS is shutdown enabled, negate to get readiness
 	return !(readI2C(TPA2016_SETUP) & TPA2016_SETUP_SWS);
 }
 
-void I2C_TPA2016::resetShort(bool right, bool left) {
+TPA2016_INLINE void I2C_TPA2016::resetShort(bool right, bool left) {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	boolWrite(TPA2016_SETUP, TPA2016_SETUP_R_FAULT, right);
+	TPA2016_RETURN_ON_ERROR();
 	boolWrite(TPA2016_SETUP, TPA2016_SETUP_L_FAULT, left);
 }
 
-bool I2C_TPA2016::rightShorted() {
+TPA2016_INLINE bool I2C_TPA2016::rightShorted() {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	return readI2C(TPA2016_SETUP) & TPA2016_SETUP_R_FAULT;
 }
 
-bool I2C_TPA2016::leftShorted() {
+TPA2016_INLINE bool I2C_TPA2016::leftShorted() {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	return readI2C(TPA2016_SETUP) & TPA2016_SETUP_L_FAULT;
 }
 
-bool I2C_TPA2016::tooHot() {
+TPA2016_INLINE bool I2C_TPA2016::tooHot() {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
 	return readI2C(TPA2016_SETUP) & TPA2016_SETUP_THERMAL;
 }
 
-void I2C_TPA2016::enableNoiseGate(bool noiseGate) {
-	if(noiseGate && compressionRatio() == TPA2016_COMPRESSION_RATIO::_1_1) {
-		throw std::logic_error("Noise Gate cannot be enabled when compression ratio is 1:1");
+TPA2016_INLINE void I2C_TPA2016::enableNoiseGate(bool noiseGate) {
+	TPA2016_PROBE_CALL(TPA2016_SETUP);
+	TPA2016_LOCK();
+	if(noiseGate) {
+		TPA2016_COMPRESSION_RATIO ratio = compressionRatio();
+		TPA2016_RETURN_ON_ERROR();
+		if(ratio == TPA2016_COMPRESSION_RATIO::_1_1) {
+			TPA2016_RAISE(std::logic_error, -EINVAL, "Noise Gate cannot be enabled when compression ratio is 1:1");
+		}
 	}
 	boolWrite(TPA2016_SETUP, TPA2016_SETUP_NOISEGATE, noiseGate);
 }
 
-bool I2C_TPA2016::noiseGateEnabled() {
+TPA2016_INLINE bool I2C_TPA2016::noiseGateEnabled() {
+  TPA2016_PROBE_CALL(TPA2016_SETUP);
+  TPA2016_LOCK();
   return readI2C(TPA2016_SETUP) & TPA2016_SETUP_NOISEGATE;
 }
 
-void I2C_TPA2016::setAttackTime(float attack) {
+TPA2016_INLINE void I2C_TPA2016::setAttackTime(float attack) {
+	TPA2016_PROBE_CALL(TPA2016_ATK);
+	TPA2016_LOCK();
 	if(attack > 80.66f || attack < 1.28f) {
-		throw std::out_of_range("Illegal attack time value : must be between 1.28ms/6dB and 80.66ms/6dB");
+		TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal attack time value : must be between 1.28ms/6dB and 80.66ms/6dB");
 	}
 	// Apply conversion table specified in datasheet for the attack time
 	writeI2C(TPA2016_ATK, static_cast<uint8_t>(attack / TPA2016_ATTACK_STEP));
 }
 
-float I2C_TPA2016::attackTime() {
+TPA2016_INLINE float I2C_TPA2016::attackTime() {
+	TPA2016_PROBE_CALL(TPA2016_ATK);
+	TPA2016_LOCK();
 	// Mask off last two bits and multiply by increment step
 	return (readI2C(TPA2016_ATK) & ~(0xC0)) * TPA2016_ATTACK_STEP;
 }
 
-void I2C_TPA2016::setReleaseTime(float release) {
+TPA2016_INLINE void I2C_TPA2016::setReleaseTime(float release) {
+	TPA2016_PROBE_CALL(TPA2016_REL);
+	TPA2016_LOCK();
 	if(release > 10.36f || release < 0.1644f) {
-		throw std::out_of_range("Illegal release time value : must be between 0.01644s/6dB and 10.36s/6dB");
+		TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal release time value : must be between 0.01644s/6dB and 10.36s/6dB");
 	}
 	writeI2C(TPA2016_REL, static_cast<uint8_t>(release / TPA2016_RELEASE_STEP));
 }
 
-float I2C_TPA2016::releaseTime() {
+TPA2016_INLINE float I2C_TPA2016::releaseTime() {
+	TPA2016_PROBE_CALL(TPA2016_REL);
+	TPA2016_LOCK();
 	// Mask off last two bits and multiply by increment step
 	return (readI2C(TPA2016_REL) & ~(0xC0)) * TPA2016_RELEASE_STEP;
 }
 
-void I2C_TPA2016::setHoldTime(float hold) {
+TPA2016_INLINE void I2C_TPA2016::setHoldTime(float hold) {
+	TPA2016_PROBE_CALL(TPA2016_HOLD);
+	TPA2016_LOCK();
 	if(hold > 0.8631f || hold < 0) {
-		throw std::out_of_range("Illegal hold time value : must be between 0 and 0.8631s/step");
+		TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal hold time value : must be between 0 and 0.8631s/step");
 	}
 	writeI2C(TPA2016_HOLD, static_cast<uint8_t>(hold / TPA2016_HOLD_STEP));
 }
 
-float I2C_TPA2016::holdTime() {
+TPA2016_INLINE float I2C_TPA2016::holdTime() {
+	TPA2016_PROBE_CALL(TPA2016_HOLD);
+	TPA2016_LOCK();
 	// Mask off last two bits and multiply by increment step
 	return (readI2C(TPA2016_HOLD) & ~(0xC0)) * TPA2016_HOLD_STEP;
 }
 
-void I2C_TPA2016::disableHoldControl() {
+TPA2016_INLINE void I2C_TPA2016::disableHoldControl() {
+	TPA2016_PROBE_CALL(TPA2016_HOLD);
+	TPA2016_LOCK();
 	writeI2C(TPA2016_HOLD, 0);
 }
 
-bool I2C_TPA2016::holdControlEnabled() {
+TPA2016_INLINE bool I2C_TPA2016::holdControlEnabled() {
+	TPA2016_PROBE_CALL(TPA2016_HOLD);
+	TPA2016_LOCK();
 	// Mask off 2 last bits : if 6 first bits are at 0, hold control is disabled
 	return readI2C(TPA2016_HOLD) & ~(0xC0);
 }
 
-void I2C_TPA2016::setGain(int8_t gain) {
-	if(compressionRatio() == TPA2016_COMPRESSION_RATIO::_1_1 && gain < 0) {
-		throw std::out_of_range("Illegal gain value : cannot be negative when compression ratio is 1:1");
-	}
+TPA2016_INLINE void I2C_TPA2016::setGain(int8_t gain) {
+	TPA2016_PROBE_CALL(TPA2016_GAIN);
+	TPA2016_LOCK();
 	if(gain > 30 || gain < -28) {
-		throw std::out_of_range("Illegal gain value : must be between -28dB and 30dB");
+		TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal gain value : must be between -28dB and 30dB");
+	}
+	if(gain < 0) {
+		TPA2016_COMPRESSION_RATIO ratio = compressionRatio();
+		TPA2016_RETURN_ON_ERROR();
+		if(ratio == TPA2016_COMPRESSION_RATIO::_1_1) {
+			TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal gain value : cannot be negative when compression ratio is 1:1");
+		}
 	}
 	/*
 	 * int8_t follows two's compliment notation. So any 5-bits number will be "left padded" with ones on bits 5, 6, 7 (remember, flip bits and add one).
@@ -202,7 +765,9 @@ void I2C_TPA2016::setGain(int8_t gain) {
 	writeI2C(TPA2016_GAIN, gain);
 }
 
-int8_t I2C_TPA2016::gain() {
+TPA2016_INLINE int8_t I2C_TPA2016::gain() {
+	TPA2016_PROBE_CALL(TPA2016_GAIN);
+	TPA2016_LOCK();
 	uint8_t gain = readI2C(TPA2016_GAIN);
 	/*
 	 * We get a 6-bits two's compliment. If bit 6 is 1, the value is negative
@@ -211,45 +776,59 @@ int8_t I2C_TPA2016::gain() {
 	return (gain & 0x20) ? gain | 0xC0 : gain;
 }
 
-void I2C_TPA2016::enableLimiter(bool limiter) {
-	if(!limiter && compressionRatio() != TPA2016_COMPRESSION_RATIO::_1_1) {
-		throw std::logic_error("Limiter cannot be disabled when compression ratio is not 1:1");
+TPA2016_INLINE void I2C_TPA2016::enableLimiter(bool limiter) {
+	TPA2016_PROBE_CALL(TPA2016_LIMITER);
+	TPA2016_LOCK();
+	if(!limiter) {
+		TPA2016_COMPRESSION_RATIO ratio = compressionRatio();
+		TPA2016_RETURN_ON_ERROR();
+		if(ratio != TPA2016_COMPRESSION_RATIO::_1_1) {
+			TPA2016_RAISE(std::logic_error, -EINVAL, "Limiter cannot be disabled when compression ratio is not 1:1");
+		}
 	}
 	boolWrite(TPA2016_LIMITER, TPA2016_LIMITER_DISABLE, !limiter);
 }
 
-bool I2C_TPA2016::limiterEnabled() {
+TPA2016_INLINE bool I2C_TPA2016::limiterEnabled() {
+	TPA2016_PROBE_CALL(TPA2016_LIMITER);
+	TPA2016_LOCK();
 	return !(readI2C(TPA2016_LIMITER) & TPA2016_LIMITER_DISABLE);
 }
 
-void I2C_TPA2016::setLimiterLevel(float limit) {
+TPA2016_INLINE void I2C_TPA2016::setLimiterLevel(float limit) {
+	TPA2016_PROBE_CALL(TPA2016_LIMITER);
+	TPA2016_LOCK();
 	if(limit > 9 || limit < -6.5) {
-		throw std::out_of_range("Illegal limiter level value : must be between -6.5dBV and 9dBV");
+		TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal limiter level value : must be between -6.5dBV and 9dBV");
 	}
 	// 0x00 is -6.5dBV
 	limit += 6.5f;
-	// Mask-off first 5 bits
-	uint8_t reg_value = readI2C(TPA2016_LIMITER) & ~0x1F;
-	reg_value |= static_cast<uint8_t>(limit / TPA2016_LIMITER_STEP);
-	writeI2C(TPA2016_LIMITER, reg_value);
+	// Replace first 5 bits
+	updateI2C(TPA2016_LIMITER, 0x1F, static_cast<uint8_t>(limit / TPA2016_LIMITER_STEP));
 }
 
-float I2C_TPA2016::limiterLevel() {
+TPA2016_INLINE float I2C_TPA2016::limiterLevel() {
+	TPA2016_PROBE_CALL(TPA2016_LIMITER);
+	TPA2016_LOCK();
 	// Get only the first 5 bits and compensate offset
 	return (readI2C(TPA2016_LIMITER) & 0x1F) * TPA2016_LIMITER_STEP - 6.5f;
 }
 
-void I2C_TPA2016::setNoiseGateThreshold(TPA2016_LIMITER_NOISEGATE threshold) {
-	if(compressionRatio() == TPA2016_COMPRESSION_RATIO::_1_1) {
-		throw std::logic_error("Noise Gate threshold cannot be changed when compression ratio is 1:1");
+TPA2016_INLINE void I2C_TPA2016::setNoiseGateThreshold(TPA2016_LIMITER_NOISEGATE threshold) {
+	TPA2016_PROBE_CALL(TPA2016_LIMITER);
+	TPA2016_LOCK();
+	TPA2016_COMPRESSION_RATIO ratio = compressionRatio();
+	TPA2016_RETURN_ON_ERROR();
+	if(ratio == TPA2016_COMPRESSION_RATIO::_1_1) {
+		TPA2016_RAISE(std::logic_error, -EINVAL, "Noise Gate threshold cannot be changed when compression ratio is 1:1");
 	}
-	// Mask-off bit 5 and 6
-	uint8_t reg_value = readI2C(TPA2016_LIMITER) & ~0x60;
-	reg_value |= static_cast<uint8_t>(threshold);
-	writeI2C(TPA2016_LIMITER, reg_value);
+	// Replace bit 5 and 6
+	updateI2C(TPA2016_LIMITER, 0x60, static_cast<uint8_t>(threshold));
 }
 
-TPA2016_LIMITER_NOISEGATE I2C_TPA2016::noiseGateThreshold() {
+TPA2016_INLINE TPA2016_LIMITER_NOISEGATE I2C_TPA2016::noiseGateThreshold() {
+	TPA2016_PROBE_CALL(TPA2016_LIMITER);
+	TPA2016_LOCK();
 	// Get only bit 5 and 6
 	uint8_t threshold = readI2C(TPA2016_LIMITER) & 0x60;
 	switch(threshold) {
@@ -262,18 +841,20 @@ TPA2016_LIMITER_NOISEGATE I2C_TPA2016::noiseGateThreshold() {
 		case 0x60:
 			return TPA2016_LIMITER_NOISEGATE::_20MV;
 		default:
-			throw std::out_of_range("Unknown noise gate threshold value");
+			TPA2016_RAISE(std::out_of_range, -ERANGE, "Unknown noise gate threshold value", TPA2016_LIMITER_NOISEGATE::_1MV);
 	}
 }
 
-void I2C_TPA2016::setCompressionRatio(TPA2016_COMPRESSION_RATIO ratio) {
-	// Mask-off bits 0 and 1
-	uint8_t reg_value = readI2C(TPA2016_AGC) & ~0x03;
-	reg_value |= static_cast<uint8_t>(ratio);
-	writeI2C(TPA2016_AGC, reg_value);
+TPA2016_INLINE void I2C_TPA2016::setCompressionRatio(TPA2016_COMPRESSION_RATIO ratio) {
+	TPA2016_PROBE_CALL(TPA2016_AGC);
+	TPA2016_LOCK();
+	// Replace bits 0 and 1
+	updateI2C(TPA2016_AGC, 0x03, static_cast<uint8_t>(ratio));
 }
 
-TPA2016_COMPRESSION_RATIO I2C_TPA2016::compressionRatio() {
+TPA2016_INLINE TPA2016_COMPRESSION_RATIO I2C_TPA2016::compressionRatio() {
+	TPA2016_PROBE_CALL(TPA2016_AGC);
+	TPA2016_LOCK();
 	// Get only bit 0 and 1
 	uint8_t ratio = readI2C(TPA2016_AGC) & 0x03;
 	switch(ratio) {
@@ -286,23 +867,317 @@ TPA2016_COMPRESSION_RATIO I2C_TPA2016::compressionRatio() {
 		case 0x03:
 			return TPA2016_COMPRESSION_RATIO::_1_8;
 		default:
-			throw std::out_of_range("Unknown compression ratio value");
+			TPA2016_RAISE(std::out_of_range, -ERANGE, "Unknown compression ratio value", TPA2016_COMPRESSION_RATIO::_1_1);
 	}
 }
 
-void I2C_TPA2016::setMaxGain(uint8_t maxGain) {
+TPA2016_INLINE void I2C_TPA2016::setMaxGain(uint8_t maxGain) {
+		TPA2016_PROBE_CALL(TPA2016_AGC);
+		TPA2016_LOCK();
 		if(maxGain > 30 || maxGain < 18) {
-			throw std::out_of_range("Illegal max gain value : should be between 18dB and 30dB");
+			TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal max gain value : should be between 18dB and 30dB");
 		}
-		uint8_t reg_value = readI2C(TPA2016_AGC);
 		// "0" is 18dB.
 		maxGain -= 18;
 		// Let the first 4 bits stay the same and change 4 last bits if needed
-		reg_value = (reg_value & 0xF) | (maxGain << 4);
-		writeI2C(TPA2016_AGC, reg_value);
+		updateI2C(TPA2016_AGC, 0xF0, maxGain << 4);
 }
 
-uint8_t I2C_TPA2016::maxGain() {
+TPA2016_INLINE uint8_t I2C_TPA2016::maxGain() {
+	TPA2016_PROBE_CALL(TPA2016_AGC);
+	TPA2016_LOCK();
 	// Don't forget to compensate the 18dB offset
 	return (readI2C(TPA2016_AGC) >> 4) + 18;
 }
+
+TPA2016_INLINE void I2C_TPA2016::setVerifyPolicy(TPA2016_VERIFY_POLICY policy, bool reapply) {
+	TPA2016_LOCK();
+	this->policy = policy;
+	this->reapply = reapply;
+}
+
+TPA2016_INLINE TPA2016_VERIFY_POLICY I2C_TPA2016::verifyPolicy() {
+	TPA2016_LOCK();
+	return policy;
+}
+
+TPA2016_INLINE void I2C_TPA2016::onMismatch(std::function<void(const TPA2016_MISMATCH&)> handler) {
+	TPA2016_LOCK();
+	mismatchHandler = handler;
+}
+
+TPA2016_INLINE std::vector<TPA2016_MISMATCH> I2C_TPA2016::verify() {
+	TPA2016_LOCK();
+	std::vector<TPA2016_MISMATCH> mismatches;
+	if(!written) {
+		return mismatches;
+	}
+	uint8_t values[TPA2016_REGISTERS];
+	readBlock(TPA2016_SETUP, TPA2016_REGISTERS, values);
+	TPA2016_RETURN_ON_ERROR(mismatches);
+	for(uint8_t reg = TPA2016_SETUP; reg <= TPA2016_REGISTERS; ++reg) {
+		check(reg, values[reg - TPA2016_SETUP], &mismatches);
+	}
+	return mismatches;
+}
+
+#ifndef TPA2016_LEAN
+TPA2016_INLINE void I2C_TPA2016::setScheduler(std::shared_ptr<I2C_TPA2016_Scheduler> scheduler) {
+	TPA2016_LOCK();
+	this->scheduler = scheduler;
+}
+
+TPA2016_INLINE void I2C_TPA2016::startStaging() {
+	TPA2016_LOCK();
+	// Another thread may start staging while the registers are read
+	uint8_t values[TPA2016_REGISTERS + 1];
+	// All registers already known : no need to read them
+	if((written >> TPA2016_SETUP) == (1 << TPA2016_REGISTERS) - 1) {
+		memcpy(values, image, sizeof(values));
+	}
+	else {
+		readBlock(TPA2016_SETUP, TPA2016_REGISTERS, values + TPA2016_SETUP);
+		TPA2016_RETURN_ON_ERROR();
+	}
+	memcpy(stage, values, sizeof(stage));
+	staged = 0;
+	staging = true;
+	// Other threads must not access the amplifier while setters only update the stage
+	mutex.lock();
+	depth++;
+}
+
+TPA2016_INLINE uint8_t I2C_TPA2016::finishStaging(uint8_t* target) {
+	memcpy(target, stage, sizeof(stage));
+	staging = false;
+	depth--;
+	mutex.unlock();
+	return staged;
+}
+#endif
+
+TPA2016_INLINE int I2C_TPA2016::scatterWrite(std::vector<TPA2016_WRITE>& writes) {
+	if(writes.empty()) {
+		return 0;
+	}
+	for(const TPA2016_WRITE& write : writes) {
+		if(!write.device) {
+			TPA2016_RAISE(std::logic_error, -EINVAL, "Amplifier of a scatter write cannot be null", -1);
+		}
+	}
+#ifndef TPA2016_LEAN
+	/*
+	 * Each ioctl and the image update which follows must not interleave with the transfers of other threads.
+	 * Every amplifier is locked, always in the same order, so that two scatter writes sharing amplifiers cannot deadlock.
+	 */
+	std::vector<I2C_TPA2016*> devices;
+	for(const TPA2016_WRITE& write : writes) {
+		devices.push_back(write.device);
+	}
+	std::sort(devices.begin(), devices.end(), std::less<I2C_TPA2016*>());
+	devices.erase(std::unique(devices.begin(), devices.end()), devices.end());
+	std::vector<std::unique_lock<std::recursive_mutex>> locks;
+	for(I2C_TPA2016* device : devices) {
+		locks.emplace_back(device->mutex);
+	}
+#endif
+	// I2C_RDWR ignores the address set with I2C_SLAVE, so any file descriptor opened on the bus will do
+	I2C_TPA2016* first = writes[0].device;
+	for(const TPA2016_WRITE& write : writes) {
+		if(write.device->bus != first->bus) {
+			TPA2016_RAISE(std::logic_error, -EINVAL, "All amplifiers of a scatter write must be on the same bus", -1);
+		}
+#ifndef TPA2016_LEAN
+		// Transfers of every amplifier must stay ordered by a single scheduler, or by none
+		if(write.device->scheduler != first->scheduler) {
+			TPA2016_RAISE(std::logic_error, -EINVAL, "All amplifiers of a scatter write must use the same scheduler", -1);
+		}
+#endif
+		if(write.reg < TPA2016_SETUP || write.reg > TPA2016_REGISTERS) {
+			TPA2016_RAISE(std::out_of_range, -ERANGE, "Illegal register address : must be between 1 and 7", -1);
+		}
+	}
+	if(!(first->funcs & I2C_FUNC_I2C)) {
+		TPA2016_RAISE(std::logic_error, -EOPNOTSUPP, "Scatter writes need an adapter supporting plain I2C transfers", -1);
+	}
+
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	// Register address followed by the values of consecutive registers
+	uint8_t buffers[I2C_RDWR_IOCTL_MAX_MSGS][TPA2016_REGISTERS + 1];
+	// Index in writes of the first write of each message, plus one past the last write
+	size_t firstWrite[I2C_RDWR_IOCTL_MAX_MSGS + 1];
+
+	// Send count messages starting at from in a single ioctl, numbered as a write transfer (see nextTransfer())
+	int fd = first->fd;
+	auto rdwr = [&](uint32_t from, uint32_t count, uint32_t& number) {
+		TPA2016_CLEAR_ERROR();
+		auto op = [fd, &msgs, from, count, &number]() {
+			struct i2c_rdwr_ioctl_data data = { &msgs[from], count };
+			if(ioctl(fd, I2C_RDWR, &data) < 0) {
+				return -errno;
+			}
+			number = nextTransfer();
+			return 0;
+		};
+		TPA2016_PROBE_START(rdwr);
+#ifndef TPA2016_LEAN
+		int res;
+		if(first->scheduler) {
+			// Pending reads of all registers written must not be merged anymore
+			std::vector<uint32_t> keys;
+			for(size_t w = firstWrite[from]; w < firstWrite[from + count]; ++w) {
+				keys.push_back(TPA2016_KEY(writes[w].device->address, writes[w].reg));
+			}
+			std::shared_future<int> result = first->scheduler->submit(op, keys);
+			// The worker never locks amplifiers : it must not wait for them, and neither should their other users
+			for(std::unique_lock<std::recursive_mutex>& lock : locks) {
+				lock.unlock();
+			}
+			res = result.get();
+			for(std::unique_lock<std::recursive_mutex>& lock : locks) {
+				lock.lock();
+			}
+		}
+		else {
+			res = op();
+		}
+#else
+		static_cast<void>(writes);
+		int res = op();
+#endif
+		TPA2016_RDWR_PROBE(first->bus, count, firstWrite[from + count] - firstWrite[from], res);
+		return res;
+	};
+	int failed = 0;
+	size_t i = 0;
+	while(i < writes.size()) {
+		uint32_t count = 0;
+		while(i < writes.size() && count < I2C_RDWR_IOCTL_MAX_MSGS) {
+			firstWrite[count] = i;
+			buffers[count][0] = writes[i].reg;
+			buffers[count][1] = writes[i].value;
+			uint16_t length = 2;
+			while(i + 1 < writes.size() && writes[i + 1].device == writes[i].device && writes[i + 1].reg == writes[i].reg + 1) {
+				buffers[count][length++] = writes[++i].value;
+			}
+			msgs[count].addr = writes[firstWrite[count]].device->address;
+			msgs[count].flags = 0;
+			msgs[count].len = length;
+			msgs[count].buf = buffers[count];
+			++count;
+			++i;
+		}
+		firstWrite[count] = i;
+
+		uint32_t number = 0;
+		int res = rdwr(0, count, number);
+		for(uint32_t m = 0; m < count; ++m) {
+			int result = res;
+			if(res < 0 && count > 1) {
+				result = rdwr(m, 1, number);
+			}
+			for(size_t w = firstWrite[m]; w < firstWrite[m + 1]; ++w) {
+				writes[w].result = result;
+				if(result < 0) {
+					++failed;
+					continue;
+				}
+				writes[w].device->record(writes[w].reg, writes[w].value, number);
+			}
+		}
+	}
+
+#ifndef TPA2016_LEAN
+	// Reads below wait for the scheduler with only their own amplifier locked
+	locks.clear();
+#endif
+	for(const TPA2016_WRITE& write : writes) {
+		if(write.result != 0) {
+			continue;
+		}
+#ifndef TPA2016_LEAN
+		Access access(write.device);
+#endif
+		if(write.device->policy == TPA2016_VERIFY_POLICY::PER_WRITE) {
+			uint8_t actual = write.device->readI2C(write.reg);
+			TPA2016_RETURN_ON_ERROR(failed);
+			write.device->check(write.reg, actual);
+		}
+	}
+	return failed;
+}
+
+TPA2016_INLINE void I2C_TPA2016::setResetRecovery(bool enable) {
+	TPA2016_LOCK();
+	recovery = enable;
+}
+
+TPA2016_INLINE bool I2C_TPA2016::checkReset() {
+	TPA2016_LOCK();
+	// Any written register which does not hold its default value reveals a reset
+	for(uint8_t reg = TPA2016_SETUP; reg <= TPA2016_REGISTERS; ++reg) {
+		if((written & (1 << reg)) && ((image[reg] ^ TPA2016_DEFAULTS[reg]) & TPA2016_STABLE_BITS[reg])) {
+			uint8_t actual = readI2C(reg, false);
+			TPA2016_RETURN_ON_ERROR(false);
+			return detectReset(reg, actual);
+		}
+	}
+	// Nothing differs from the defaults : a reset would not change anything
+	return false;
+}
+
+TPA2016_INLINE TPA2016_RECOVERY_METRICS I2C_TPA2016::recoveryMetrics() {
+	TPA2016_LOCK();
+	return recoveryStats;
+}
+
+TPA2016_INLINE void I2C_TPA2016::snapshot() {
+	TPA2016_LOCK();
+	// All registers already known : no need to read them
+	if((written >> TPA2016_SETUP) == (1 << TPA2016_REGISTERS) - 1) {
+		return;
+	}
+	uint8_t values[TPA2016_REGISTERS + 1];
+	readBlock(TPA2016_SETUP, TPA2016_REGISTERS, values + TPA2016_SETUP);
+	TPA2016_RETURN_ON_ERROR();
+	// Written registers keep their value : a reset which happened meanwhile must not become the configuration
+	for(uint8_t reg = TPA2016_SETUP; reg <= TPA2016_REGISTERS; ++reg) {
+		if(!(written & (1 << reg))) {
+			record(reg, values[reg], 0);
+		}
+	}
+}
+
+TPA2016_INLINE void I2C_TPA2016::sleep() {
+	TPA2016_LOCK();
+	snapshot();
+	TPA2016_RETURN_ON_ERROR();
+	// Writing 1 to fault flags has no effect : a latched fault stays for the user to see
+	writeI2C(TPA2016_SETUP, image[TPA2016_SETUP] | TPA2016_SETUP_SWS | TPA2016_SETUP_R_FAULT | TPA2016_SETUP_L_FAULT);
+}
+
+TPA2016_INLINE uint8_t I2C_TPA2016::wakeUp() {
+	TPA2016_LOCK();
+	// Only clear software shutdown : writing 0 to fault flags would acknowledge a short which happened before or during sleep
+	image[TPA2016_SETUP] = (image[TPA2016_SETUP] & ~TPA2016_SETUP_SWS) | TPA2016_SETUP_R_FAULT | TPA2016_SETUP_L_FAULT;
+	written |= 1 << TPA2016_SETUP;
+	uint8_t last = TPA2016_REGISTERS;
+	while(!(written & (1 << last))) {
+		--last;
+	}
+	// Unknown registers are skipped : each run of known registers is written with a single block write
+	uint8_t transactions = 0;
+	uint8_t first = TPA2016_SETUP;
+	for(uint8_t reg = TPA2016_SETUP; reg <= last + 1; ++reg) {
+		if(reg <= last && (written & (1 << reg))) {
+			continue;
+		}
+		if(reg > first) {
+			writeBlock(first, reg - first, image + first);
+			TPA2016_RETURN_ON_ERROR(transactions);
+			transactions += (reg - first > 1 && (funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) ? 1 : reg - first;
+		}
+		first = reg + 1;
+	}
+	return transactions;
+}
@@ -18,12 +18,31 @@
  *
  * So, in order to set multiple parameters at once, you just need to do the binary OR
  * of the differents constants which refer to the same register, and write the value in the register.
+ *
+ * Build configurations :
+ *	- Default : shared library, errors are reported with exceptions
+ *	- TPA2016_LEAN : no scheduler (and thus no thread), meant to be built with -fno-exceptions, see "make lean".
+ *	  An amplifier must then only be used by a single thread.
+ *	- TPA2016_HEADER_ONLY : the implementation is included by this header and declared inline, so that getters and setters
+ *	  can be inlined in the caller. Meant to be used with TPA2016_LEAN, nothing has to be linked then.
+ *	- TPA2016_NO_PROBES : no USDT probes, even if sys/sdt.h (systemtap-sdt-dev) is installed
+ *
+ * When exceptions are disabled, a function which would throw returns immediately instead (getters then return a meaningless value)
+ * and the error is available with I2C_TPA2016::lastError().
+ *
+ * USDT probes (provider tpa2016) let perf, bpftrace or bcc trace every transaction of a running program, see tools/.
+ * They cost a nop when nothing is attached, and transfers are only timed while a tracer is attached.
  */
 
 #ifndef I2CTPA2016_H_
 #define I2CTPA2016_H_
 
-#include <iostream>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -37,6 +56,40 @@ extern "C" {
 }
 #endif
 
+#ifndef TPA2016_LEAN
+#include <atomic>
+#include <memory>
+#include <mutex>
+#endif
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#include <stdexcept>
+// Report an error. The trailing argument is the value returned by the function when exceptions are disabled.
+#define TPA2016_RAISE(exception, code, message, ...) throw (TPA2016_PROBE_ERROR(code), exception(message))
+// Return if a call made by the current function failed. Nothing to do with exceptions.
+#define TPA2016_RETURN_ON_ERROR(...)
+#define TPA2016_CLEAR_ERROR()
+#else
+#define TPA2016_NO_EXCEPTIONS
+#define TPA2016_RAISE(exception, code, message, ...) do { I2C_TPA2016::errorCode() = (code); TPA2016_PROBE_ERROR(code); return __VA_ARGS__; } while(0)
+#define TPA2016_RETURN_ON_ERROR(...) do { if(I2C_TPA2016::errorCode()) return __VA_ARGS__; } while(0)
+#define TPA2016_CLEAR_ERROR() (I2C_TPA2016::errorCode() = 0)
+#endif
+
+#if !defined(TPA2016_NO_PROBES) && __has_include(<sys/sdt.h>)
+#define TPA2016_PROBES
+// Keep the error for the call probe of the public function being traced (the semaphore is defined by I2C_TPA2016.cpp, the only user)
+#define TPA2016_PROBE_ERROR(code) static_cast<void>(__builtin_expect(tpa2016_call_semaphore, 0) ? I2C_TPA2016::probed().error = -(code) : 0)
+#else
+#define TPA2016_PROBE_ERROR(code) static_cast<void>(code)
+#endif
+
+#ifdef TPA2016_HEADER_ONLY
+#define TPA2016_INLINE inline
+#else
+#define TPA2016_INLINE
+#endif
+
 #define MAX_BUF_NAME 64
 #define MAX_BUF_ERROR 200
 
@@ -57,6 +110,8 @@ extern "C" {
 // Bit 1 is unused
 // Enables Noise Gate function (bit 0)
 #define TPA2016_SETUP_NOISEGATE 0x01
+// Status bits which are changed by the amplifier itself, and therefore never compared when verifying writes
+#define TPA2016_SETUP_VOLATILE (TPA2016_SETUP_R_FAULT | TPA2016_SETUP_L_FAULT | TPA2016_SETUP_THERMAL)
 
 // Register 2 : AGC Attack control. Only the first 6 bits are used.
 #define TPA2016_ATK 0x2
@@ -94,6 +149,9 @@ Only the first 5 bits are used. Two's compliment. */
 // Defaut I2C address
 #define TPA2016_I2CADDR 0x58
 
+// Number of control registers (1 to 7)
+#define TPA2016_REGISTERS 7
+
 enum class TPA2016_LIMITER_NOISEGATE: uint8_t {
 	_1MV = 0x00,
 	_4MV = 0x20,
@@ -108,12 +166,59 @@ enum class TPA2016_COMPRESSION_RATIO: uint8_t {
 	 _1_8 = 0x03 // 1:8
 };
 
+enum class TPA2016_VERIFY_POLICY: uint8_t {
+	NONE, // Writes are never checked
+	PER_WRITE, // Each write is immediately read back
+	BATCHED // Writes are checked all at once with a single block read, see I2C_TPA2016::verify()
+};
+
+/**
+ * Register whose content differs from the last value written by the library.
+ * Volatile bits (fault and thermal flags, unused bits) are already masked off.
+ */
+struct TPA2016_MISMATCH {
+	uint8_t reg;
+	uint8_t expected;
+	uint8_t actual;
+};
+
+/**
+ * Resets of the amplifier (brown-out, SHDN pin pulled low...) detected and recovered by the library.
+ * Recovery time is measured from the read which revealed the reset to the end of the restoration.
+ */
+struct TPA2016_RECOVERY_METRICS {
+	uint32_t resets;
+	// Write transactions used by the last restoration
+	uint8_t lastWrites;
+	std::chrono::nanoseconds lastRecovery;
+	std::chrono::nanoseconds maxRecovery;
+	std::chrono::nanoseconds totalRecovery;
+};
+
+class I2C_TPA2016;
+#ifndef TPA2016_LEAN
+class I2C_TPA2016_Scheduler;
+class I2C_TPA2016_Scene;
+#endif
+
+/**
+ * Write of one register of one amplifier, see I2C_TPA2016::scatterWrite()
+ */
+struct TPA2016_WRITE {
+	I2C_TPA2016* device;
+	uint8_t reg;
+	uint8_t value;
+	// Set by scatterWrite() : 0 on success, -errno otherwise
+	int result;
+};
+
 class I2C_TPA2016
 {
 public:
 	// Constructor and destructor
 	/**
 	 * Opens a I2C connection and configure device as a slave
+	 * Without exceptions, check lastError() after construction.
 	 * @param bus     But number (I2C adapter)
 	 * @param address Address of the slave device
 	 * @throw std::runtime_error If any error when configuring device
@@ -229,15 +334,224 @@ public:
 	 */
 	void setMaxGain(uint8_t maxGain);
 	uint8_t maxGain();
+
+	// Write verification
+	/**
+	 * Choose how writes are checked against the register image kept by the library.
+	 * @param policy  NONE (default), PER_WRITE (one read after each write) or BATCHED (see verify())
+	 * @param reapply If true, a mismatching register is written again with its expected value (short-circuit flags stay latched)
+	 */
+	void setVerifyPolicy(TPA2016_VERIFY_POLICY policy, bool reapply = false);
+	TPA2016_VERIFY_POLICY verifyPolicy();
+	/**
+	 * Register a function called for each mismatch found, whatever the policy
+	 */
+	void onMismatch(std::function<void(const TPA2016_MISMATCH&)> handler);
+	/**
+	 * Read registers 1 to 7 in a single block read and compare them against every value written so far.
+	 * Meant to be called after a group of writes when policy is BATCHED, but works with any policy.
+	 * softMode() and hardcoreMode() call it by themselves when policy is BATCHED.
+	 * @return Registers which do not hold the expected value
+	 * @throw std::runtime_error If the registers cannot be read
+	 */
+	std::vector<TPA2016_MISMATCH> verify();
+
+	// Reset detection
+	/**
+	 * Detect resets of the amplifier during normal reads and restore the written configuration.
+	 * A reset is suspected when a register reads its power-on default instead of the value written by the library,
+	 * and confirmed with a single block read : every written register which differs from its default must read its default.
+	 * The registers which lost their value are then written again, with a single block write if the adapter allows it.
+	 * @param enable Disabled by default
+	 */
+	void setResetRecovery(bool enable);
+	/**
+	 * Check for a reset with a single read, e.g. on each tick of a monitoring loop, and recover if needed.
+	 * Works even if automatic recovery is disabled.
+	 * @return true if a reset was detected and recovered
+	 * @throw std::runtime_error If the registers cannot be read or written
+	 */
+	bool checkReset();
+	TPA2016_RECOVERY_METRICS recoveryMetrics();
+
+	// Fast wake-up
+	/**
+	 * Read all registers in a single block read and keep the ones never written by the library as if they had been,
+	 * so that wakeUp() (and verification) covers the whole configuration. Nothing is read if all registers are known.
+	 * Registers written by the library keep the value written : if the amplifier was reset, wakeUp() restores them.
+	 * @throw std::runtime_error If the registers cannot be read
+	 */
+	void snapshot();
+	/**
+	 * Take a snapshot, then enable software shutdown from the known configuration : at most a block read and a single write.
+	 * @throw std::runtime_error If the registers cannot be read or written
+	 */
+	void sleep();
+	/**
+	 * Clear software shutdown and write back every known register, in a single block write if the adapter allows it.
+	 * Registers which were never written nor snapshot are left untouched, and short-circuit flags stay latched.
+	 * @return Number of write transactions
+	 * @throw std::runtime_error If the registers cannot be written
+	 */
+	uint8_t wakeUp();
+
+	/**
+	 * Error of the last call of the current thread which accessed an amplifier or was given illegal arguments.
+	 * Only meaningful when exceptions are disabled, always 0 otherwise.
+	 * @return 0 on success, -errno for I2C errors, -ERANGE instead of std::out_of_range, -EINVAL instead of std::logic_error
+	 */
+	static int lastError() { return errorCode(); }
+
+#ifndef TPA2016_LEAN
+	/**
+	 * Send all subsequent transfers through a scheduler instead of accessing the bus directly.
+	 * See I2C_TPA2016_Scheduler.h.
+	 * @param scheduler Typically I2C_TPA2016_Scheduler::forBus(bus), nullptr to access the bus directly again
+	 */
+	void setScheduler(std::shared_ptr<I2C_TPA2016_Scheduler> scheduler);
+#endif
+
+	/**
+	 * Write registers of one or several amplifiers of the same bus with a single I2C_RDWR ioctl per
+	 * I2C_RDWR_IOCTL_MAX_MSGS messages, instead of one syscall per register.
+	 * Consecutive registers of the same amplifier are packed in a single message (the amplifier auto-increments the register address).
+	 * Cross-conditions are not checked : values are written as is.
+	 * If a message fails, the messages of its ioctl are sent again one by one to know which ones failed.
+	 * Every amplifier is locked during each ioctl and the update of its registers kept in memory, except while waiting for the scheduler.
+	 * @param writes Writes to perform, in order. Their result field is set.
+	 * @return Number of failed writes
+	 * @throw std::logic_error If an amplifier is null, if amplifiers are not on the same bus or do not use the same scheduler,
+	 *                          or if the adapter does not support plain I2C transfers
+	 * @throw std::out_of_range If a register address is not between 1 and 7
+	 */
+	static int scatterWrite(std::vector<TPA2016_WRITE>& writes);
 private:
+#ifndef TPA2016_LEAN
+	friend class I2C_TPA2016_Scene;
+#endif
 	uint8_t bus;
 	uint8_t address;
 	int fd;
-	uint8_t readI2C(uint8_t regAddress);
+	// Functionalities of the I2C adapter, see I2C_FUNCS
+	unsigned long funcs;
+	// Last value written in each register, indexed by register address
+	uint8_t image[TPA2016_REGISTERS + 1];
+	// Bit n is set if register n has been written at least once and thus image[n] is meaningful
+	uint8_t written;
+	TPA2016_VERIFY_POLICY policy;
+	bool reapply;
+	std::function<void(const TPA2016_MISMATCH&)> mismatchHandler;
+	bool recovery;
+	TPA2016_RECOVERY_METRICS recoveryStats;
+#ifndef TPA2016_LEAN
+	// Held by every public function, so that an amplifier can be shared by several threads. Released while waiting for the scheduler.
+	std::recursive_mutex mutex;
+	// Number of times mutex is held by Access objects of the thread which owns it
+	uint8_t depth;
+	// Holds mutex until destruction
+	class Access;
+	// Number of the transfer which wrote the value of each register kept in image, see nextTransfer()
+	uint32_t sequence[TPA2016_REGISTERS + 1];
+	std::shared_ptr<I2C_TPA2016_Scheduler> scheduler;
+	// While staging, reads and writes only use stage instead of accessing the amplifier
+	bool staging;
+	uint8_t stage[TPA2016_REGISTERS + 1];
+	// Bit n is set if register n has been written while staging
+	uint8_t staged;
+	/**
+	 * Start staging : load the current content of the registers, then let setters compute register values without any transfer.
+	 * Other threads cannot access the amplifier until finishStaging().
+	 * @throw std::runtime_error If the registers cannot be read
+	 */
+	void startStaging();
+	/**
+	 * Stop staging
+	 * @param target Filled with the staged registers, indexed by register address
+	 * @return Registers written while staging (bit n for register n)
+	 */
+	uint8_t finishStaging(uint8_t* target);
+#endif
+	/**
+	 * Number a write transfer when it is performed. With a scheduler, the transfers of other threads may be performed
+	 * in any order while this one waits : the numbers tell which value ends up in a register.
+	 * @return Increasing number, never 0 (always 0 with the lean build)
+	 */
+	static uint32_t nextTransfer();
+	/**
+	 * Keep a value written in the image, unless a later transfer already wrote the register.
+	 * @param transfer Number of the write transfer, 0 if the value was read before any write still unrecorded
+	 */
+	void record(uint8_t reg, uint8_t value, uint32_t transfer);
+	static int& errorCode() {
+		static thread_local int code = 0;
+		return code;
+	}
+#ifdef TPA2016_PROBES
+	// Outcome of the last transfer of the current thread, reported by the call probe (error is a positive errno)
+	struct Probed {
+		uint8_t value;
+		int error;
+	};
+	static Probed& probed() {
+		static thread_local Probed last = Probed();
+		return last;
+	}
+	// Fires the call probe when the public function which declares it returns
+	class CallProbe;
+#endif
+	/**
+	 * Perform an I2C transfer, directly or through the scheduler if any.
+	 * @param op   Function doing the actual transfer, returns a non-negative value or -errno
+	 * @param reg   First register accessed
+	 * @param read  If the transfer does not modify the registers
+	 * @param count Number of consecutive registers accessed
+	 * @return Value returned by op
+	 */
+	template<typename Op>
+	int transfer(Op op, uint8_t reg, bool read, uint8_t count = 1);
+	/**
+	 * @param detect If a reset of the amplifier should be looked for, see setResetRecovery()
+	 */
+	uint8_t readI2C(uint8_t regAddress, bool detect = true);
 	void writeI2C(uint8_t regAddress, uint8_t value);
+	/**
+	 * Replace some bits of a register with a single transfer : another thread cannot write the register in between.
+	 * @param mask Bits to replace
+	 * @param bits New value of these bits
+	 */
+	void updateI2C(uint8_t regAddress, uint8_t mask, uint8_t bits);
+	/**
+	 * Read count consecutive registers starting at first, in a single transaction if the adapter allows it.
+	 * @param values Buffer of at least count bytes
+	 */
+	void readBlock(uint8_t first, uint8_t count, uint8_t* values);
+	/**
+	 * Write count consecutive registers starting at first, in a single transaction if the adapter allows it.
+	 * Only the registers already written by the library are recorded in the image.
+	 */
+	void writeBlock(uint8_t first, uint8_t count, const uint8_t* values);
+	/**
+	 * Confirm and recover a reset after reading a register
+	 * @param actual Value just read in reg
+	 * @return true if a reset was recovered
+	 */
+	bool detectReset(uint8_t reg, uint8_t actual);
+	/**
+	 * Write again the registers which do not hold their expected value, in as few transactions as possible.
+	 * @param values Current content of the registers, indexed by register address
+	 * @return Number of write transactions
+	 */
+	uint8_t restore(const uint8_t* values);
+	/**
+	 * Compare the value read in a register with the expected image and report a mismatch if any.
+	 * @param mismatches If not null, the mismatch is also appended to it
+	 * @return true if the register holds the expected value
+	 */
+	bool check(uint8_t reg, uint8_t actual, std::vector<TPA2016_MISMATCH>* mismatches = nullptr);
 	/**
 	 * Small helper to avoid code duplication.
 	 * Are there is a lot of "toggle-bit" functions which basically does the same thing, modulo register address and bit position, this should replace boilerplate code.
+	 * The read-modify-write is a single transfer, see updateI2C().
 	 * @param reg    Address of the 8-bit register to write
 	 * @param bit    Bitmask corresponding to "true" for the feature
 	 * @param enable If the feature should be enabled
@@ -245,4 +559,8 @@ private:
 	void boolWrite(uint8_t reg, uint8_t bit, bool enable);
 };
 
+#ifdef TPA2016_HEADER_ONLY
+#include "I2C_TPA2016.cpp"
+#endif
+
 #endif /* I2CTPA2016_H_ */
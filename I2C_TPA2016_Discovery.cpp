@@ -0,0 +1,128 @@
+#include "I2C_TPA2016_Discovery.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <future>
+#include <memory>
+#include <stdlib.h>
+#include <thread>
+
+std::vector<TPA2016_DEVICE_INFO> I2C_TPA2016_Discovery::discover(std::chrono::milliseconds timeout, const std::vector<uint8_t>& addresses) {
+	std::vector<uint8_t> buses;
+	DIR* dev = opendir("/dev");
+	if(dev) {
+		struct dirent* entry;
+		while((entry = readdir(dev)) != nullptr) {
+			char* end;
+			if(strncmp(entry->d_name, "i2c-", 4) != 0) {
+				continue;
+			}
+			long bus = strtol(entry->d_name + 4, &end, 10);
+			// The constructor of I2C_TPA2016 only accepts 8-bits bus numbers
+			if(end != entry->d_name + 4 && *end == '\0' && bus >= 0 && bus <= UINT8_MAX) {
+				buses.push_back(bus);
+			}
+		}
+		closedir(dev);
+	}
+	return discover(buses, timeout, addresses);
+}
+
+std::vector<TPA2016_DEVICE_INFO> I2C_TPA2016_Discovery::discover(const std::vector<uint8_t>& buses, std::chrono::milliseconds timeout, const std::vector<uint8_t>& addresses) {
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+	/*
+	 * A bus stuck in a transfer is not waited for : its thread is detached and finishes on its own. Each thread
+	 * therefore owns its copy of the addresses and shares its result with the caller, never the other way round.
+	 */
+	std::vector<std::future<std::vector<TPA2016_DEVICE_INFO>>> results;
+	for(uint8_t bus : buses) {
+		std::shared_ptr<std::promise<std::vector<TPA2016_DEVICE_INFO>>> result = std::make_shared<std::promise<std::vector<TPA2016_DEVICE_INFO>>>();
+		results.push_back(result->get_future());
+		std::thread([bus, deadline, addresses, result]() {
+			std::vector<TPA2016_DEVICE_INFO> found;
+			probeBus(bus, deadline, addresses, found);
+			result->set_value(std::move(found));
+		}).detach();
+	}
+
+	std::vector<TPA2016_DEVICE_INFO> found;
+	for(std::future<std::vector<TPA2016_DEVICE_INFO>>& result : results) {
+		if(result.wait_until(deadline) == std::future_status::ready) {
+			std::vector<TPA2016_DEVICE_INFO> bus = result.get();
+			found.insert(found.end(), bus.begin(), bus.end());
+		}
+	}
+	std::sort(found.begin(), found.end(), [](const TPA2016_DEVICE_INFO& a, const TPA2016_DEVICE_INFO& b) {
+		return a.bus != b.bus ? a.bus < b.bus : a.address < b.address;
+	});
+	return found;
+}
+
+bool I2C_TPA2016_Discovery::fingerprint(const uint8_t* registers) {
+	// Register 1 : bit 1 is unused and reads 1
+	if(!(registers[TPA2016_SETUP] & 0x02)) {
+		return false;
+	}
+	// Registers 2 to 4 : only the first 6 bits are used
+	for(uint8_t reg = TPA2016_ATK; reg <= TPA2016_HOLD; ++reg) {
+		if(registers[reg] & 0xC0) {
+			return false;
+		}
+	}
+	// Register 5 is not checked : the sign of the gain may be extended to the unused bits
+	// Register 7 : bits 2 and 3 are unused
+	return !(registers[TPA2016_AGC] & 0x0C);
+}
+
+void I2C_TPA2016_Discovery::probeBus(uint8_t bus, std::chrono::steady_clock::time_point deadline, const std::vector<uint8_t>& addresses, std::vector<TPA2016_DEVICE_INFO>& found) {
+	char filename[MAX_BUF_NAME];
+	snprintf(filename, sizeof(filename), "/dev/i2c-%d", bus);
+	int fd = open(filename, O_RDWR);
+	if(fd < 0) {
+		return;
+	}
+	unsigned long funcs;
+	if(ioctl(fd, I2C_FUNCS, &funcs) < 0 || !(funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+		close(fd);
+		return;
+	}
+	/*
+	 * Stop between addresses once the budget is spent. A transfer already started is not cut short : I2C_TIMEOUT and
+	 * I2C_RETRIES would change the settings of the whole adapter, for every other client, and they would outlive
+	 * this probe. discover() does not wait for it anyway.
+	 */
+	for(uint8_t address : addresses) {
+		if(std::chrono::steady_clock::now() >= deadline) {
+			break;
+		}
+		// Fails with EBUSY if a kernel driver owns the address : leave it alone
+		if(ioctl(fd, I2C_SLAVE, address) < 0) {
+			continue;
+		}
+		TPA2016_DEVICE_INFO info;
+		info.bus = bus;
+		info.address = address;
+		info.registers[0] = 0;
+		// Nobody answers : don't waste time on a block read
+		int setup = i2c_smbus_read_byte_data(fd, TPA2016_SETUP);
+		if(setup < 0) {
+			continue;
+		}
+		info.registers[TPA2016_SETUP] = setup;
+		bool complete = true;
+		if(funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) {
+			complete = i2c_smbus_read_i2c_block_data(fd, TPA2016_ATK, TPA2016_REGISTERS - 1, info.registers + TPA2016_ATK) == TPA2016_REGISTERS - 1;
+		}
+		else {
+			for(uint8_t reg = TPA2016_ATK; reg <= TPA2016_REGISTERS && complete; ++reg) {
+				int value = i2c_smbus_read_byte_data(fd, reg);
+				complete = value >= 0;
+				info.registers[reg] = value;
+			}
+		}
+		if(complete && fingerprint(info.registers)) {
+			found.push_back(info);
+		}
+	}
+	close(fd);
+}
@@ -0,0 +1,68 @@
+/*
+ * I2C_TPA2016_Discovery.h
+ *
+ * Find TPA2016D2 amplifiers without knowing their bus beforehand.
+ *
+ * All adapters are probed at the same time (one thread per bus), and discovery returns when the time budget is spent :
+ * a bus still busy by then is left out of the result, and its thread finishes in the background.
+ * Probing only reads registers : the state of the amplifiers (and of any other device) is never changed.
+ *
+ * Sample usage :
+ *	for(const TPA2016_DEVICE_INFO& info : I2C_TPA2016_Discovery::discover()) {
+ *		I2C_TPA2016 tpa(info.bus, info.address);
+ *	}
+ */
+
+#ifndef I2CTPA2016_DISCOVERY_H_
+#define I2CTPA2016_DISCOVERY_H_
+
+#include "I2C_TPA2016.h"
+
+#include <chrono>
+#include <vector>
+
+/**
+ * Amplifier found by discovery, ready to be given to the I2C_TPA2016 constructor
+ */
+struct TPA2016_DEVICE_INFO {
+	uint8_t bus;
+	uint8_t address;
+	// Content of the registers when probed, indexed by register address
+	uint8_t registers[TPA2016_REGISTERS + 1];
+};
+
+class I2C_TPA2016_Discovery
+{
+public:
+	/**
+	 * Probe all adapters found in /dev (i2c-*)
+	 * @param timeout   Time budget of the whole discovery. Buses which have not been fully probed by then are left out
+	 *                  of the result. Their threads are detached, and may last as long as the timeout of the adapter.
+	 * @param addresses Candidate addresses
+	 * @return Amplifiers found, sorted by bus then address
+	 */
+	static std::vector<TPA2016_DEVICE_INFO> discover(std::chrono::milliseconds timeout = std::chrono::milliseconds(100),
+		const std::vector<uint8_t>& addresses = { TPA2016_I2CADDR });
+	/**
+	 * Probe the given adapters only
+	 * @param buses Bus numbers (I2C adapters). Missing or unusable adapters are ignored.
+	 */
+	static std::vector<TPA2016_DEVICE_INFO> discover(const std::vector<uint8_t>& buses,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(100),
+		const std::vector<uint8_t>& addresses = { TPA2016_I2CADDR });
+	/**
+	 * Tell if registers 1 to 7 look like the ones of a TPA2016D2 : unused bits must read as documented in the datasheet.
+	 * @param registers Content of the registers, indexed by register address
+	 */
+	static bool fingerprint(const uint8_t* registers);
+private:
+	/**
+	 * Probe the candidate addresses of a single bus
+	 * @param deadline No address is probed after it
+	 * @param found    Amplifiers found are appended to it
+	 */
+	static void probeBus(uint8_t bus, std::chrono::steady_clock::time_point deadline, const std::vector<uint8_t>& addresses,
+		std::vector<TPA2016_DEVICE_INFO>& found);
+};
+
+#endif /* I2CTPA2016_DISCOVERY_H_ */
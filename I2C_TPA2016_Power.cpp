@@ -0,0 +1,71 @@
+#include "I2C_TPA2016_Power.h"
+
+I2C_TPA2016_PowerManager::I2C_TPA2016_PowerManager(I2C_TPA2016& device, clock::duration idle) : device(device), stats() {
+	this->idle = idle;
+	lastActivity = clock::now();
+	sleeping = false;
+	playing = false;
+}
+
+I2C_TPA2016& I2C_TPA2016_PowerManager::use() {
+	wake();
+	lastActivity = clock::now();
+	return device;
+}
+
+void I2C_TPA2016_PowerManager::silence(bool silent) {
+	if(playing == silent) {
+		// Idle period starts when sound stops
+		lastActivity = clock::now();
+	}
+	playing = !silent;
+	if(playing) {
+		wake();
+	}
+}
+
+bool I2C_TPA2016_PowerManager::tick() {
+	if(sleeping || playing || clock::now() - lastActivity < idle) {
+		return false;
+	}
+	// Keep the whole configuration, including registers never written by the library, for wake()
+	device.sleep();
+	sleeping = true;
+	stats.shutdowns++;
+	return true;
+}
+
+void I2C_TPA2016_PowerManager::wake() {
+	if(!sleeping) {
+		return;
+	}
+	clock::time_point start = clock::now();
+	uint8_t writes = device.wakeUp();
+	std::chrono::nanoseconds latency = clock::now() - start;
+
+	sleeping = false;
+	lastActivity = clock::now();
+	stats.wakes++;
+	stats.lastWakeWrites = writes;
+	stats.lastWake = latency;
+	stats.totalWake += latency;
+	if(latency > stats.maxWake) {
+		stats.maxWake = latency;
+	}
+}
+
+bool I2C_TPA2016_PowerManager::asleep() {
+	return sleeping;
+}
+
+void I2C_TPA2016_PowerManager::setIdleTimeout(clock::duration idle) {
+	this->idle = idle;
+}
+
+I2C_TPA2016_PowerManager::clock::duration I2C_TPA2016_PowerManager::idleTimeout() {
+	return idle;
+}
+
+TPA2016_POWER_METRICS I2C_TPA2016_PowerManager::metrics() {
+	return stats;
+}
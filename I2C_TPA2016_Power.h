@@ -0,0 +1,91 @@
+/*
+ * I2C_TPA2016_Power.h
+ *
+ * Idle power management of an amplifier.
+ *
+ * The amplifier is put in software shutdown once it has been idle for a while : no control activity through use(),
+ * and no sound according to the host (see silence()). Its whole configuration stays in memory, so that waking it up
+ * only takes a single block write which clears software shutdown and restores every register at once
+ * (about 1ms at 100kHz).
+ *
+ * There is no thread : tick() must be called periodically, typically by the loop which already monitors the amplifier.
+ * This class is not thread-safe, even though the amplifier it manages is : use(), silence() and tick() must be called
+ * from a single thread, or under a lock of the caller.
+ *
+ * Sample usage :
+ *	I2C_TPA2016_PowerManager power(tpa, std::chrono::minutes(10));
+ *	power.use().setGain(12);
+ *	while(running) {
+ *		power.silence(audioIsSilent());
+ *		power.tick();
+ *		sleep(1);
+ *	}
+ */
+
+#ifndef I2CTPA2016_POWER_H_
+#define I2CTPA2016_POWER_H_
+
+#include "I2C_TPA2016.h"
+
+#include <chrono>
+
+struct TPA2016_POWER_METRICS {
+	uint32_t shutdowns;
+	uint32_t wakes;
+	// Write transactions used by the last wake-up
+	uint8_t lastWakeWrites;
+	// Wake-up latency, from the request to the restored configuration
+	std::chrono::nanoseconds lastWake;
+	std::chrono::nanoseconds maxWake;
+	std::chrono::nanoseconds totalWake;
+};
+
+class I2C_TPA2016_PowerManager
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * @param device Amplifier, which must outlive the manager. It is considered awake and in use.
+	 * @param idle   Idle time before software shutdown
+	 */
+	I2C_TPA2016_PowerManager(I2C_TPA2016& device, clock::duration idle = std::chrono::minutes(5));
+
+	/**
+	 * Access the amplifier to control it : wakes it up if needed and restarts the idle period.
+	 * @throw std::runtime_error If the amplifier cannot be woken up
+	 */
+	I2C_TPA2016& use();
+	/**
+	 * Signal from the host about the audio stream. The amplifier is never shut down while sound is playing,
+	 * and is woken up as soon as sound starts.
+	 * @param silent true if no sound is being played
+	 * @throw std::runtime_error If the amplifier cannot be woken up
+	 */
+	void silence(bool silent);
+	/**
+	 * Shut the amplifier down if it has been idle long enough.
+	 * @return true if the amplifier has just been shut down
+	 * @throw std::runtime_error If the amplifier cannot be accessed
+	 */
+	bool tick();
+	/**
+	 * Wake the amplifier up, if asleep
+	 * @throw std::runtime_error If the registers cannot be written
+	 */
+	void wake();
+	bool asleep();
+
+	void setIdleTimeout(clock::duration idle);
+	clock::duration idleTimeout();
+	TPA2016_POWER_METRICS metrics();
+private:
+	I2C_TPA2016& device;
+	clock::duration idle;
+	clock::time_point lastActivity;
+	bool sleeping;
+	bool playing;
+	TPA2016_POWER_METRICS stats;
+};
+
+#endif /* I2CTPA2016_POWER_H_ */
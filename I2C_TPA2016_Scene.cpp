@@ -0,0 +1,130 @@
+#include "I2C_TPA2016_Scene.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+
+I2C_TPA2016_Scene::I2C_TPA2016_Scene(std::chrono::nanoseconds skewBound) {
+	this->skewBound = skewBound;
+}
+
+void I2C_TPA2016_Scene::add(I2C_TPA2016& device, std::function<void(I2C_TPA2016&)> configure) {
+	Target target;
+	target.device = &device;
+	device.startStaging();
+	try {
+		configure(device);
+	}
+	catch(...) {
+		device.finishStaging(target.image);
+		throw;
+	}
+	target.changed = device.finishStaging(target.image);
+	targets.push_back(target);
+}
+
+TPA2016_SCENE_REPORT I2C_TPA2016_Scene::apply() {
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start = clock::now();
+
+	// Split writes by bus and by phase : everything but the gain first, then the gain
+	std::map<uint8_t, std::vector<TPA2016_WRITE>> setup;
+	std::map<uint8_t, std::vector<TPA2016_WRITE>> gains;
+	for(const Target& target : targets) {
+		I2C_TPA2016* device = target.device;
+		std::lock_guard<std::recursive_mutex> lock(device->mutex);
+		for(uint8_t reg = TPA2016_SETUP; reg <= TPA2016_REGISTERS; ++reg) {
+			uint8_t value = target.image[reg];
+			uint8_t compared = 0xFF;
+			if(reg == TPA2016_SETUP) {
+				// Fault flags were read by add() : writing 1 has no effect, so that a short latched since then stays for the user to see
+				value |= TPA2016_SETUP_R_FAULT | TPA2016_SETUP_L_FAULT;
+				compared = ~TPA2016_SETUP_VOLATILE;
+			}
+			bool known = device->written & (1 << reg);
+			if(!(target.changed & (1 << reg)) || (known && !((device->image[reg] ^ value) & compared))) {
+				continue;
+			}
+			TPA2016_WRITE write = { device, reg, value, 0 };
+			(reg == TPA2016_GAIN ? gains : setup)[device->bus].push_back(write);
+		}
+	}
+	// Create both entries for every bus, so that the maps are not modified by the threads
+	for(auto& bus : setup) {
+		gains[bus.first];
+	}
+	for(auto& bus : gains) {
+		setup[bus.first];
+	}
+
+	// Every bus thread waits for the others between the two phases
+	std::mutex mutex;
+	std::condition_variable allReady;
+	size_t ready = 0;
+	size_t buses = gains.size();
+	clock::time_point firstGain = clock::time_point::max();
+	clock::time_point lastGain = clock::time_point::min();
+	std::exception_ptr error;
+
+	std::vector<std::thread> threads;
+	for(auto& bus : gains) {
+		std::vector<TPA2016_WRITE>* setupWrites = &setup[bus.first];
+		std::vector<TPA2016_WRITE>* gainWrites = &bus.second;
+		threads.emplace_back([&, setupWrites, gainWrites]() {
+			try {
+				I2C_TPA2016::scatterWrite(*setupWrites);
+			}
+			catch(...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				error = std::current_exception();
+			}
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if(++ready == buses) {
+					allReady.notify_all();
+				}
+				else {
+					allReady.wait(lock, [&]() { return ready == buses; });
+				}
+				if(error || gainWrites->empty()) {
+					return;
+				}
+			}
+			clock::time_point phaseStart = clock::now();
+			try {
+				I2C_TPA2016::scatterWrite(*gainWrites);
+			}
+			catch(...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				error = std::current_exception();
+			}
+			clock::time_point phaseEnd = clock::now();
+			std::lock_guard<std::mutex> lock(mutex);
+			firstGain = std::min(firstGain, phaseStart);
+			lastGain = std::max(lastGain, phaseEnd);
+		});
+	}
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+	if(error) {
+		std::rethrow_exception(error);
+	}
+
+	TPA2016_SCENE_REPORT report = TPA2016_SCENE_REPORT();
+	for(auto* phase : { &setup, &gains }) {
+		for(auto& bus : *phase) {
+			for(const TPA2016_WRITE& write : bus.second) {
+				report.writes++;
+				report.failed += write.result < 0;
+			}
+		}
+	}
+	report.applyTime = clock::now() - start;
+	report.maxSkew = firstGain < lastGain ? lastGain - firstGain : std::chrono::nanoseconds::zero();
+	report.withinBound = report.maxSkew <= skewBound;
+	return report;
+}
@@ -0,0 +1,86 @@
+/*
+ * I2C_TPA2016_Scene.h
+ *
+ * Synchronized configuration change of many amplifiers, possibly on several buses.
+ *
+ * Calling setters amplifier after amplifier spreads a change over a long time, so that listeners hear
+ * the zones change one after the other. A scene instead :
+ *	- Computes the target registers of every amplifier beforehand, using the usual setters and cross-condition checks
+ *	  but without any transfer (see add())
+ *	- Writes everything but the gain, with one thread and as few I2C_RDWR ioctl as possible per bus
+ *	- Waits for all buses, then writes the gain of every amplifier in a tight final phase, which is what listeners hear
+ *
+ * Sample usage :
+ *	I2C_TPA2016_Scene scene;
+ *	for(I2C_TPA2016* tpa : zone) {
+ *		scene.add(*tpa, [](I2C_TPA2016& staged) {
+ *			staged.setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_4);
+ *			staged.setMaxGain(24);
+ *			staged.setGain(12);
+ *		});
+ *	}
+ *	TPA2016_SCENE_REPORT report = scene.apply();
+ */
+
+#ifndef I2CTPA2016_SCENE_H_
+#define I2CTPA2016_SCENE_H_
+
+#include "I2C_TPA2016.h"
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+struct TPA2016_SCENE_REPORT {
+	// Register writes performed
+	size_t writes;
+	// Writes which failed (see TPA2016_WRITE::result)
+	size_t failed;
+	// Duration of the whole apply()
+	std::chrono::nanoseconds applyTime;
+	/*
+	 * Upper bound of the time between the first and the last gain change :
+	 * from the start of the first final phase transfer to the end of the last one, across all buses.
+	 */
+	std::chrono::nanoseconds maxSkew;
+	// If maxSkew is below the bound given to the scene
+	bool withinBound;
+};
+
+class I2C_TPA2016_Scene
+{
+public:
+	/**
+	 * @param skewBound Maximum acceptable skew between amplifiers, see TPA2016_SCENE_REPORT::withinBound
+	 */
+	I2C_TPA2016_Scene(std::chrono::nanoseconds skewBound = std::chrono::milliseconds(1));
+
+	/**
+	 * Compute the target registers of an amplifier. Nothing is written until apply().
+	 * @param device    Amplifier, which must outlive the scene
+	 * @param configure Calls setters on the amplifier given as parameter. Getters return the staged values.
+	 * @throw std::out_of_range, std::logic_error As thrown by the setters. The amplifier is then not added.
+	 * @throw std::runtime_error If the registers of the amplifier cannot be read
+	 */
+	void add(I2C_TPA2016& device, std::function<void(I2C_TPA2016&)> configure);
+
+	/**
+	 * Write the scene. Only registers which differ from the ones known by each amplifier are written.
+	 * The scene can be applied again later.
+	 * @return Report of the scene switch
+	 * @throw std::logic_error If an adapter does not support plain I2C transfers
+	 */
+	TPA2016_SCENE_REPORT apply();
+private:
+	struct Target {
+		I2C_TPA2016* device;
+		uint8_t image[TPA2016_REGISTERS + 1];
+		// Bit n is set if register n was written by the configuration
+		uint8_t changed;
+	};
+
+	std::vector<Target> targets;
+	std::chrono::nanoseconds skewBound;
+};
+
+#endif /* I2CTPA2016_SCENE_H_ */
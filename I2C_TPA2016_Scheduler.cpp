@@ -0,0 +1,208 @@
+#include "I2C_TPA2016_Scheduler.h"
+
+#include <errno.h>
+#include <map>
+#include <stdexcept>
+
+// Class and timeout of the transfers issued by the current thread, changed by Scope
+static thread_local TPA2016_PRIORITY currentPriority = TPA2016_PRIORITY::CONTROL;
+static thread_local I2C_TPA2016_Scheduler::clock::duration currentTimeout = I2C_TPA2016_Scheduler::clock::duration::zero();
+
+I2C_TPA2016_Scheduler::Scope::Scope(TPA2016_PRIORITY priority, clock::duration timeout) {
+	previousPriority = currentPriority;
+	previousTimeout = currentTimeout;
+	currentPriority = priority;
+	currentTimeout = timeout;
+}
+
+I2C_TPA2016_Scheduler::Scope::~Scope() {
+	currentPriority = previousPriority;
+	currentTimeout = previousTimeout;
+}
+
+I2C_TPA2016_Scheduler::I2C_TPA2016_Scheduler(float budget) : counters() {
+	setBudget(budget);
+	stopping = false;
+	nextSlot = clock::now();
+	worker = std::thread(&I2C_TPA2016_Scheduler::run, this);
+}
+
+I2C_TPA2016_Scheduler::~I2C_TPA2016_Scheduler() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_one();
+	worker.join();
+}
+
+std::shared_ptr<I2C_TPA2016_Scheduler> I2C_TPA2016_Scheduler::forBus(uint8_t bus) {
+	static std::mutex registryMutex;
+	static std::map<uint8_t, std::weak_ptr<I2C_TPA2016_Scheduler>> registry;
+
+	std::lock_guard<std::mutex> lock(registryMutex);
+	std::shared_ptr<I2C_TPA2016_Scheduler> scheduler = registry[bus].lock();
+	if(!scheduler) {
+		scheduler = std::make_shared<I2C_TPA2016_Scheduler>();
+		registry[bus] = scheduler;
+	}
+	return scheduler;
+}
+
+std::shared_future<int> I2C_TPA2016_Scheduler::submit(std::function<int()> transfer, uint32_t key, bool read) {
+	clock::time_point now = clock::now();
+	clock::time_point deadline = currentTimeout == clock::duration::zero() ? clock::time_point::max() : now + currentTimeout;
+	uint8_t priority = static_cast<uint8_t>(currentPriority);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if(key && !read) {
+		invalidate(key);
+	}
+	else if(key) {
+		for(uint8_t i = 0; i < TPA2016_PRIORITIES; ++i) {
+			for(auto it = queues[i].begin(); it != queues[i].end(); ++it) {
+				std::shared_ptr<Request> pending = *it;
+				if(pending->key != key || !pending->read) {
+					continue;
+				}
+				counters.merged[priority]++;
+				if(deadline < pending->deadline) {
+					pending->deadline = deadline;
+				}
+				// Promote the pending read so that the caller is not delayed by the merge
+				if(priority < i) {
+					pending->priority = currentPriority;
+					queues[priority].push_back(pending);
+					queues[i].erase(it);
+				}
+				return pending->future;
+			}
+		}
+	}
+	return enqueue(transfer, key, read, now, deadline);
+}
+
+std::shared_future<int> I2C_TPA2016_Scheduler::submit(std::function<int()> transfer, const std::vector<uint32_t>& keys) {
+	clock::time_point now = clock::now();
+	clock::time_point deadline = currentTimeout == clock::duration::zero() ? clock::time_point::max() : now + currentTimeout;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for(uint32_t key : keys) {
+		invalidate(key);
+	}
+	return enqueue(transfer, 0, false, now, deadline);
+}
+
+void I2C_TPA2016_Scheduler::invalidate(uint32_t key) {
+	for(uint8_t i = 0; i < TPA2016_PRIORITIES; ++i) {
+		for(std::shared_ptr<Request>& pending : queues[i]) {
+			// The register is about to change : later reads must not get the value read before the write
+			if(pending->key == key && pending->read) {
+				pending->key = 0;
+			}
+		}
+	}
+}
+
+std::shared_future<int> I2C_TPA2016_Scheduler::enqueue(std::function<int()> transfer, uint32_t key, bool read,
+		clock::time_point submitted, clock::time_point deadline) {
+	std::shared_ptr<Request> request = std::make_shared<Request>();
+	request->transfer = transfer;
+	request->key = key;
+	request->read = read;
+	request->priority = currentPriority;
+	request->submitted = submitted;
+	request->deadline = deadline;
+	request->future = request->result.get_future().share();
+	queues[static_cast<uint8_t>(currentPriority)].push_back(request);
+	wakeUp.notify_one();
+	return request->future;
+}
+
+void I2C_TPA2016_Scheduler::setBudget(float budget) {
+	if(budget <= 0 || budget > 1) {
+		throw std::out_of_range("Illegal bus budget : must be greater than 0 and at most 1");
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	busBudget = budget;
+}
+
+float I2C_TPA2016_Scheduler::budget() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return busBudget;
+}
+
+TPA2016_SCHEDULER_METRICS I2C_TPA2016_Scheduler::metrics() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return counters;
+}
+
+std::shared_ptr<I2C_TPA2016_Scheduler::Request> I2C_TPA2016_Scheduler::next() {
+	clock::time_point now = clock::now();
+	for(uint8_t i = 0; i < TPA2016_PRIORITIES; ++i) {
+		auto chosen = queues[i].end();
+		for(auto it = queues[i].begin(); it != queues[i].end();) {
+			if((*it)->deadline < now) {
+				counters.expired[i]++;
+				(*it)->result.set_value(-ETIME);
+				it = queues[i].erase(it);
+				continue;
+			}
+			// Earliest deadline first, then first submitted
+			if(chosen == queues[i].end() || (*it)->deadline < (*chosen)->deadline) {
+				chosen = it;
+			}
+			++it;
+		}
+		if(chosen != queues[i].end()) {
+			std::shared_ptr<Request> request = *chosen;
+			queues[i].erase(chosen);
+			return request;
+		}
+	}
+	return nullptr;
+}
+
+void I2C_TPA2016_Scheduler::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while(true) {
+		bool empty = true;
+		for(uint8_t i = 0; i < TPA2016_PRIORITIES; ++i) {
+			empty = empty && queues[i].empty();
+		}
+		if(empty) {
+			if(stopping) {
+				return;
+			}
+			wakeUp.wait(lock);
+			continue;
+		}
+		// Respect the budget before choosing, so that a request arriving meanwhile can still take precedence
+		if(clock::now() < nextSlot) {
+			wakeUp.wait_until(lock, nextSlot);
+			continue;
+		}
+		std::shared_ptr<Request> request = next();
+		if(!request) {
+			continue;
+		}
+		lock.unlock();
+
+		clock::time_point start = clock::now();
+		int result = request->transfer();
+		clock::time_point end = clock::now();
+
+		lock.lock();
+		uint8_t priority = static_cast<uint8_t>(request->priority);
+		std::chrono::nanoseconds delay = start - request->submitted;
+		counters.executed[priority]++;
+		counters.totalDelay[priority] += delay;
+		if(delay > counters.maxDelay[priority]) {
+			counters.maxDelay[priority] = delay;
+		}
+		counters.busTime += end - start;
+		// Stay idle long enough so that the transfer only accounts for busBudget of the elapsed time
+		nextSlot = end + std::chrono::duration_cast<clock::duration>((end - start) * (1 / busBudget - 1));
+		request->result.set_value(result);
+	}
+}
@@ -0,0 +1,168 @@
+/*
+ * I2C_TPA2016_Scheduler.h
+ *
+ * Transaction scheduler for an I2C bus shared by several amplifiers (and possibly other devices).
+ *
+ * Without a scheduler, every I2C_TPA2016 call hits the bus immediately, so a gain change issued by the user
+ * may have to wait behind a batch of telemetry reads. Once attached to an amplifier (see I2C_TPA2016::setScheduler()),
+ * all its transfers go through a single worker thread per bus which :
+ *	- Serves priority classes in order : user-facing control, then safety polling, then telemetry
+ *	- Serves the earliest deadline first inside a class, and drops transfers whose deadline has passed
+ *	- Merges pending reads of the same register of the same amplifier into a single transfer. Setters which change
+ *	  part of a register read and write it in a single transfer, which is never merged
+ *	- Keeps the bus time used by the driver below a given fraction (rate budget)
+ *
+ * The priority class and the deadline of the calls made by a thread are chosen with a Scope object :
+ *	{
+ *		I2C_TPA2016_Scheduler::Scope scope(TPA2016_PRIORITY::TELEMETRY, std::chrono::milliseconds(50));
+ *		tpa.rightShorted();
+ *	}
+ */
+
+#ifndef I2CTPA2016_SCHEDULER_H_
+#define I2CTPA2016_SCHEDULER_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of priority classes
+#define TPA2016_PRIORITIES 3
+
+// Lower value is served first
+enum class TPA2016_PRIORITY: uint8_t {
+	CONTROL = 0, // User-facing changes (volume, gain...). Default class.
+	SAFETY = 1, // Fault and thermal polling
+	TELEMETRY = 2 // Diagnostic reads
+};
+
+/**
+ * Counters of a scheduler, indexed by priority class.
+ * Queueing delay is the time between submission of a transfer and the moment it starts on the bus.
+ */
+struct TPA2016_SCHEDULER_METRICS {
+	// Transfers actually performed on the bus
+	uint64_t executed[TPA2016_PRIORITIES];
+	// Reads served by an identical pending read
+	uint64_t merged[TPA2016_PRIORITIES];
+	// Transfers dropped because their deadline passed before they could start
+	uint64_t expired[TPA2016_PRIORITIES];
+	std::chrono::nanoseconds totalDelay[TPA2016_PRIORITIES];
+	std::chrono::nanoseconds maxDelay[TPA2016_PRIORITIES];
+	// Time spent in transfers
+	std::chrono::nanoseconds busTime;
+};
+
+class I2C_TPA2016_Scheduler
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * Sets the priority class and deadline of the transfers issued by the current thread, until destruction.
+	 * Scopes can be nested.
+	 */
+	class Scope
+	{
+	public:
+		/**
+		 * @param priority Class of the transfers
+		 * @param timeout  Maximum time a transfer can wait before starting, no deadline if zero
+		 */
+		Scope(TPA2016_PRIORITY priority, clock::duration timeout = clock::duration::zero());
+		~Scope();
+	private:
+		TPA2016_PRIORITY previousPriority;
+		clock::duration previousTimeout;
+	};
+
+	/**
+	 * Starts the worker thread
+	 * @param budget Maximum fraction of bus time used by the scheduled transfers (0 < budget <= 1)
+	 * @throw std::out_of_range
+	 */
+	I2C_TPA2016_Scheduler(float budget = 1.0f);
+	/**
+	 * Stops the worker thread. Pending transfers are still performed.
+	 */
+	~I2C_TPA2016_Scheduler();
+
+	/**
+	 * Returns the scheduler shared by all amplifiers of a bus, creating it if needed
+	 * @param bus Bus number (I2C adapter)
+	 */
+	static std::shared_ptr<I2C_TPA2016_Scheduler> forBus(uint8_t bus);
+
+	/**
+	 * Queue a transfer. Priority and deadline are taken from the current Scope.
+	 * @param transfer Function performing the transfer, returning a non-negative value or -errno
+	 * @param key      Identifier of the register accessed (0 if none). A write with a key prevents the
+	 *                 reads already pending with the same key to be merged with the following ones.
+	 * @param read     If true and key is not 0, the transfer may be merged with a pending read of the same key
+	 * @return Result of the transfer, -ETIME if its deadline passed before it could start
+	 */
+	std::shared_future<int> submit(std::function<int()> transfer, uint32_t key = 0, bool read = false);
+	/**
+	 * Queue a write of several registers (block write, or write to several amplifiers)
+	 * @param keys Identifiers of all the registers written : pending reads of these registers are not merged anymore
+	 * @return Result of the transfer, -ETIME if its deadline passed before it could start
+	 */
+	std::shared_future<int> submit(std::function<int()> transfer, const std::vector<uint32_t>& keys);
+
+	/**
+	 * @param budget Maximum fraction of bus time used by the scheduled transfers (0 < budget <= 1)
+	 * @throw std::out_of_range
+	 */
+	void setBudget(float budget);
+	float budget();
+	TPA2016_SCHEDULER_METRICS metrics();
+private:
+	struct Request {
+		std::function<int()> transfer;
+		uint32_t key;
+		bool read;
+		TPA2016_PRIORITY priority;
+		clock::time_point submitted;
+		// clock::time_point::max() if none
+		clock::time_point deadline;
+		std::promise<int> result;
+		std::shared_future<int> future;
+	};
+
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::list<std::shared_ptr<Request>> queues[TPA2016_PRIORITIES];
+	float busBudget;
+	bool stopping;
+	TPA2016_SCHEDULER_METRICS counters;
+	// The bus cannot be used before this point, to respect the budget
+	clock::time_point nextSlot;
+	std::thread worker;
+
+	void run();
+	/**
+	 * Prevent the pending reads of a register from being merged with the following ones.
+	 * Must be called with mutex locked.
+	 */
+	void invalidate(uint32_t key);
+	/**
+	 * Queue a new request with the priority of the current thread.
+	 * Must be called with mutex locked.
+	 */
+	std::shared_future<int> enqueue(std::function<int()> transfer, uint32_t key, bool read,
+		clock::time_point submitted, clock::time_point deadline);
+	/**
+	 * Remove and return the next request to perform, nullptr if all queues are empty.
+	 * Must be called with mutex locked.
+	 */
+	std::shared_ptr<Request> next();
+};
+
+#endif /* I2CTPA2016_SCHEDULER_H_ */
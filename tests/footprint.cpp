@@ -0,0 +1,83 @@
+/*
+ * Compare the build configurations of the library, see "make footprint" :
+ *	- Startup time : average time to spawn this program and return from main(), without touching the amplifier
+ *	- Per-call overhead : average time of a getter and a setter on a real amplifier
+ *
+ * Binary size is given by size(1) in the Makefile target.
+ * Usage : footprint [bus]
+ */
+
+#include <I2C_TPA2016.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define SPAWNS 200
+#define CALLS 1000
+
+extern char **environ;
+
+static double elapsedNs(const struct timespec& start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static void measureStartup(char* self) {
+	char flag[] = "--startup";
+	char* args[] = { self, flag, nullptr };
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < SPAWNS; ++i) {
+		pid_t pid;
+		int status;
+		if(posix_spawn(&pid, self, nullptr, nullptr, args, environ) != 0 || waitpid(pid, &status, 0) < 0) {
+			fprintf(stderr, "Unable to spawn %s\n", self);
+			return;
+		}
+	}
+	printf("  startup : %.1f us\n", elapsedNs(start) / SPAWNS / 1000);
+}
+
+static void measureCalls(uint8_t bus) {
+#ifdef TPA2016_NO_EXCEPTIONS
+	I2C_TPA2016 tpa(bus);
+	if(I2C_TPA2016::lastError()) {
+		printf("  calls : no amplifier on bus %d (%s)\n", bus, strerror(-I2C_TPA2016::lastError()));
+		return;
+	}
+#else
+	try {
+		I2C_TPA2016 tpa(bus);
+#endif
+		volatile int8_t sink = 0;
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int i = 0; i < CALLS; ++i) {
+			sink = tpa.gain();
+		}
+		double getter = elapsedNs(start) / CALLS;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int i = 0; i < CALLS; ++i) {
+			tpa.setGain(sink);
+		}
+		double setter = elapsedNs(start) / CALLS;
+		printf("  gain() : %.0f ns/call\n  setGain() : %.0f ns/call\n", getter, setter);
+#ifndef TPA2016_NO_EXCEPTIONS
+	}
+	catch(const std::exception& e) {
+		printf("  calls : no amplifier on bus %d (%s)\n", bus, e.what());
+	}
+#endif
+}
+
+int main(int argc, char* argv[]) {
+	if(argc > 1 && strcmp(argv[1], "--startup") == 0) {
+		return 0;
+	}
+	printf("%s\n", argv[0]);
+	measureStartup(argv[0]);
+	measureCalls(argc > 1 ? atoi(argv[1]) : 1);
+	return 0;
+}
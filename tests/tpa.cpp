@@ -1,5 +1,12 @@
 #include <catch.hpp>
 #include <I2C_TPA2016.h>
+#include <I2C_TPA2016_Scheduler.h>
+#include <I2C_TPA2016_Scene.h>
+#include <I2C_TPA2016_Discovery.h>
+#include <I2C_TPA2016_Power.h>
+
+#include <future>
+#include <thread>
 
 // Test of default values
 SCENARIO("Amplifier default values are expected") {
@@ -311,3 +318,307 @@ SCENARIO("Cross-conditions") {
 		}
 	}
 }
+
+SCENARIO("Write verification") {
+	GIVEN("An I2C connection on bus 1") {
+		I2C_TPA2016 tpa(1);
+		int reported = 0;
+		tpa.onMismatch([&reported](const TPA2016_MISMATCH&) { ++reported; });
+		WHEN("Writes are checked one by one") {
+			tpa.setVerifyPolicy(TPA2016_VERIFY_POLICY::PER_WRITE);
+			tpa.setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_2);
+			tpa.setGain(12);
+			THEN("No mismatch is reported") {
+				CHECK(reported == 0);
+			}
+		}
+		WHEN("Writes are checked as a batch") {
+			tpa.setVerifyPolicy(TPA2016_VERIFY_POLICY::BATCHED);
+			tpa.softMode();
+			tpa.setMaxGain(24);
+			THEN("The block read matches every written register") {
+				CHECK(tpa.verify().empty());
+				CHECK(reported == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("Scheduled transfers") {
+	GIVEN("An I2C connection on bus 1 going through the bus scheduler") {
+		I2C_TPA2016 tpa(1);
+		std::shared_ptr<I2C_TPA2016_Scheduler> scheduler = I2C_TPA2016_Scheduler::forBus(1);
+		tpa.setScheduler(scheduler);
+		WHEN("The gain is changed and read back as telemetry") {
+			tpa.setGain(12);
+			int8_t gain;
+			{
+				I2C_TPA2016_Scheduler::Scope scope(TPA2016_PRIORITY::TELEMETRY, std::chrono::seconds(1));
+				gain = tpa.gain();
+			}
+			THEN("The value is the one written") {
+				CHECK(gain == 12);
+			}
+			THEN("Each transfer is accounted in its class") {
+				TPA2016_SCHEDULER_METRICS metrics = scheduler->metrics();
+				CHECK(metrics.executed[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)] > 0);
+				CHECK(metrics.executed[static_cast<uint8_t>(TPA2016_PRIORITY::TELEMETRY)] == 1);
+			}
+		}
+		WHEN("Two threads change different bits of the same register") {
+			std::thread channels([&tpa]() {
+				for(int i = 0; i < 100; ++i) {
+					tpa.enableChannels(i % 2, i % 2);
+				}
+			});
+			std::thread shutdown([&tpa]() {
+				for(int i = 0; i < 100; ++i) {
+					tpa.softwareShutdown(i % 2 == 0);
+				}
+			});
+			channels.join();
+			shutdown.join();
+			THEN("No change is lost") {
+				CHECK(tpa.rightEnabled());
+				CHECK(tpa.leftEnabled());
+				CHECK(tpa.ready());
+			}
+		}
+		WHEN("A control read is issued while a telemetry read of another thread is pending") {
+			tpa.setGain(9);
+			// Keep the worker busy so that the telemetry read stays in the queue
+			std::promise<void> busy;
+			std::shared_future<void> release = busy.get_future().share();
+			scheduler->submit([release]() { release.wait(); return 0; });
+			uint64_t merged = scheduler->metrics().merged[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)];
+			int8_t telemetry = 0;
+			std::thread poller([&tpa, &telemetry]() {
+				I2C_TPA2016_Scheduler::Scope scope(TPA2016_PRIORITY::TELEMETRY);
+				telemetry = tpa.gain();
+			});
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			std::thread releaser([&busy]() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				busy.set_value();
+			});
+			int8_t control = tpa.gain();
+			poller.join();
+			releaser.join();
+			THEN("The amplifier is not held by the waiting thread, and both reads are merged") {
+				CHECK(control == 9);
+				CHECK(telemetry == 9);
+				CHECK(scheduler->metrics().merged[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)] == merged + 1);
+			}
+		}
+		WHEN("The bus budget is invalid") {
+			THEN("An out-of-range exception should be thrown") {
+				CHECK_THROWS_AS(scheduler->setBudget(0), std::out_of_range);
+			}
+		}
+	}
+}
+
+SCENARIO("Scatter writes") {
+	GIVEN("An I2C connection on bus 1") {
+		I2C_TPA2016 tpa(1);
+		WHEN("Attack, release and hold times are written at once") {
+			std::vector<TPA2016_WRITE> writes = {
+				{ &tpa, TPA2016_ATK, 0x02, -1 },
+				{ &tpa, TPA2016_REL, 0x14, -1 },
+				{ &tpa, TPA2016_HOLD, 0x03, -1 }
+			};
+			int failed = I2C_TPA2016::scatterWrite(writes);
+			THEN("Each write succeeds") {
+				CHECK(failed == 0);
+				for(const TPA2016_WRITE& write : writes) {
+					CHECK(write.result == 0);
+				}
+			}
+			THEN("Registers hold the new values") {
+				CHECK(tpa.attackTime() == 2.56f);
+				CHECK(tpa.holdTime() == 0.0411f);
+				CHECK(tpa.verify().empty());
+			}
+		}
+		WHEN("A register address is invalid") {
+			std::vector<TPA2016_WRITE> writes = { { &tpa, 8, 0x00, -1 } };
+			THEN("An out-of-range exception should be thrown") {
+				CHECK_THROWS_AS(I2C_TPA2016::scatterWrite(writes), std::out_of_range);
+			}
+		}
+		WHEN("An amplifier is missing") {
+			std::vector<TPA2016_WRITE> writes = { { &tpa, TPA2016_ATK, 0x02, -1 }, { nullptr, TPA2016_ATK, 0x02, -1 } };
+			THEN("A logic error exception should be thrown") {
+				CHECK_THROWS_AS(I2C_TPA2016::scatterWrite(writes), std::logic_error);
+			}
+		}
+		WHEN("Amplifiers do not use the same scheduler") {
+			I2C_TPA2016 scheduled(1);
+			scheduled.setScheduler(I2C_TPA2016_Scheduler::forBus(1));
+			std::vector<TPA2016_WRITE> writes = { { &tpa, TPA2016_ATK, 0x02, -1 }, { &scheduled, TPA2016_REL, 0x14, -1 } };
+			THEN("A logic error exception should be thrown") {
+				CHECK_THROWS_AS(I2C_TPA2016::scatterWrite(writes), std::logic_error);
+			}
+		}
+		WHEN("Amplifiers write through their scheduler") {
+			std::shared_ptr<I2C_TPA2016_Scheduler> scheduler = I2C_TPA2016_Scheduler::forBus(1);
+			tpa.setScheduler(scheduler);
+			uint64_t executed = scheduler->metrics().executed[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)];
+			std::vector<TPA2016_WRITE> writes = { { &tpa, TPA2016_ATK, 0x03, -1 } };
+			I2C_TPA2016::scatterWrite(writes);
+			THEN("The ioctl is performed by the scheduler") {
+				CHECK(scheduler->metrics().executed[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)] == executed + 1);
+				CHECK(tpa.attackTime() == 3.84f);
+			}
+		}
+	}
+}
+
+SCENARIO("Reset detection") {
+	GIVEN("An I2C connection on bus 1 with reset recovery") {
+		I2C_TPA2016 tpa(1);
+		tpa.setResetRecovery(true);
+		WHEN("The configuration is changed and the amplifier keeps it") {
+			tpa.setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_2);
+			tpa.setGain(20);
+			THEN("No reset is detected") {
+				CHECK(!tpa.checkReset());
+				CHECK(tpa.gain() == 20);
+				CHECK(tpa.recoveryMetrics().resets == 0);
+			}
+		}
+		WHEN("Another client puts back the power-on values, as a reset would") {
+			tpa.setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_2);
+			tpa.setAttackTime(2.56f);
+			tpa.setGain(20);
+			// Must outlive the checks : its destructor shuts the amplifier down
+			I2C_TPA2016 other(1);
+			std::vector<TPA2016_WRITE> defaults = {
+				{ &other, TPA2016_SETUP, 0xC3, -1 },
+				{ &other, TPA2016_ATK, 0x05, -1 },
+				{ &other, TPA2016_REL, 0x0B, -1 },
+				{ &other, TPA2016_HOLD, 0x00, -1 },
+				{ &other, TPA2016_GAIN, 0x06, -1 },
+				{ &other, TPA2016_LIMITER, 0x3A, -1 },
+				{ &other, TPA2016_AGC, 0xC2, -1 }
+			};
+			I2C_TPA2016::scatterWrite(defaults);
+			int8_t gain = tpa.gain();
+			THEN("The reset is detected and the configuration is restored") {
+				CHECK(gain == 20);
+				CHECK(tpa.recoveryMetrics().resets == 1);
+				CHECK(tpa.attackTime() == 2.56f);
+				CHECK(tpa.compressionRatio() == TPA2016_COMPRESSION_RATIO::_1_2);
+				CHECK(tpa.ready());
+			}
+		}
+	}
+}
+
+SCENARIO("Scene switching") {
+	GIVEN("An I2C connection on bus 1") {
+		I2C_TPA2016 tpa(1);
+		tpa.setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_1);
+		tpa.setGain(0);
+		I2C_TPA2016_Scene scene;
+		WHEN("A scene changing compression and gain is applied") {
+			scene.add(tpa, [](I2C_TPA2016& staged) {
+				staged.setCompressionRatio(TPA2016_COMPRESSION_RATIO::_1_4);
+				staged.setMaxGain(24);
+				staged.setGain(-10);
+			});
+			THEN("Nothing is written before the scene is applied") {
+				CHECK(tpa.gain() == 0);
+				CHECK(tpa.compressionRatio() == TPA2016_COMPRESSION_RATIO::_1_1);
+			}
+			TPA2016_SCENE_REPORT report = scene.apply();
+			THEN("Every register holds its new value") {
+				CHECK(report.failed == 0);
+				CHECK(tpa.gain() == -10);
+				CHECK(tpa.maxGain() == 24);
+				CHECK(tpa.compressionRatio() == TPA2016_COMPRESSION_RATIO::_1_4);
+			}
+			THEN("Applying the scene again writes nothing") {
+				CHECK(scene.apply().writes == 0);
+			}
+		}
+		WHEN("A scene breaks a cross-condition") {
+			THEN("The setter exception is thrown when adding the amplifier") {
+				CHECK_THROWS_AS(scene.add(tpa, [](I2C_TPA2016& staged) { staged.setGain(-10); }), std::out_of_range);
+			}
+		}
+	}
+}
+
+SCENARIO("Discovery") {
+	GIVEN("An amplifier on bus 1") {
+		WHEN("All buses are probed") {
+			std::vector<TPA2016_DEVICE_INFO> found = I2C_TPA2016_Discovery::discover();
+			THEN("The amplifier is found at its default address") {
+				bool present = false;
+				for(const TPA2016_DEVICE_INFO& info : found) {
+					present = present || (info.bus == 1 && info.address == TPA2016_I2CADDR);
+				}
+				CHECK(present);
+			}
+		}
+		WHEN("Registers do not match the datasheet") {
+			uint8_t registers[TPA2016_REGISTERS + 1] = { 0x00, 0xC3, 0x05, 0x0B, 0x00, 0x06, 0x3A, 0xCE };
+			THEN("They are not recognized as a TPA2016D2") {
+				CHECK(!I2C_TPA2016_Discovery::fingerprint(registers));
+			}
+		}
+	}
+}
+
+SCENARIO("Idle power management") {
+	GIVEN("An amplifier managed without idle delay") {
+		I2C_TPA2016 tpa(1);
+		I2C_TPA2016_PowerManager power(tpa, std::chrono::milliseconds(0));
+		power.use().setGain(6);
+		WHEN("Sound is playing") {
+			power.silence(false);
+			THEN("The amplifier is never shut down") {
+				CHECK(!power.tick());
+				CHECK(tpa.ready());
+			}
+		}
+		WHEN("The amplifier is idle") {
+			std::shared_ptr<I2C_TPA2016_Scheduler> scheduler = I2C_TPA2016_Scheduler::forBus(1);
+			tpa.setScheduler(scheduler);
+			uint64_t executed = scheduler->metrics().executed[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)];
+			power.silence(true);
+			bool shutdown = power.tick();
+			THEN("It is shut down with a block read and a single write") {
+				CHECK(shutdown);
+				CHECK(scheduler->metrics().executed[static_cast<uint8_t>(TPA2016_PRIORITY::CONTROL)] == executed + 2);
+				CHECK(power.asleep());
+				CHECK(!tpa.ready());
+			}
+		}
+		WHEN("The amplifier is used again") {
+			power.tick();
+			int gain = power.use().gain();
+			THEN("It is woken up with its configuration in a single write") {
+				CHECK(!power.asleep());
+				CHECK(tpa.ready());
+				CHECK(gain == 6);
+				CHECK(power.metrics().wakes == 1);
+				CHECK(power.metrics().lastWakeWrites == 1);
+			}
+		}
+		WHEN("The amplifier is reset before going idle") {
+			power.use().setGain(20);
+			// Must outlive the checks : its destructor shuts the amplifier down
+			I2C_TPA2016 other(1);
+			std::vector<TPA2016_WRITE> defaults = { { &other, TPA2016_GAIN, 0x06, -1 } };
+			I2C_TPA2016::scatterWrite(defaults);
+			power.tick();
+			int gain = power.use().gain();
+			THEN("The configuration written before the reset is restored on wake-up") {
+				CHECK(tpa.ready());
+				CHECK(gain == 20);
+			}
+		}
+	}
+}